@@ -28,7 +28,8 @@ void mu_handle(tbl_t *err, eh_t *eh) {
 mu_noreturn void mu_err(tbl_t *err, eh_t *eh) {
     // Just jump to the seteh call. We'll let it take care 
     // of handling things since it has more stack space
-    longjmp(eh->env, (int)err);
+    eh->err = err;
+    longjmp(eh->env, 1);
 }
 
 mu_noreturn void mu_cerr(var_t type, var_t reason, eh_t *eh) {
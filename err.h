@@ -26,6 +26,7 @@ typedef struct eh eh_t;
 
 struct eh {
     tbl_t *handles;
+    tbl_t *err;
     jmp_buf env;
 };
 
@@ -46,8 +47,10 @@ mu_noreturn void err_undefined(eh_t *eh);
 #define mu_try_begin(eh) {                  \
     eh_t _eh;                               \
     _eh.handles = 0;                        \
+    _eh.err = 0;                            \
                                             \
-    tbl_t *_err = (tbl_t *)setjmp(_eh.env); \
+    tbl_t *_err = setjmp(_eh.env) ?         \
+                  _eh.err : 0;              \
                                             \
     if (mu_unlikely(_err != 0))             \
         mu_handle(_err, &_eh);              \
@@ -16,50 +16,67 @@
 static fn_t *fn_realize(struct fnparse *fnparse, eh_t *eh) {
     // this is a bit tricky since fn and p->fn share memory
     fn_t *fn = (fn_t *)fnparse;
-    tbl_t *vars = fnparse->vars;
-    tbl_t *fns = fnparse->fns;
+    struct vparse *vars = fnparse->vars;
+    struct fparse *fns = fnparse->fns;
     
+    fn->stack = mu_stack(fnparse->bcode, fnparse->ins, eh);
     fn->vcount = vars->len;
     fn->fcount = fns->len;
-    fn->stack = 25; // TODO make this reasonable
 
     fn->vars = mu_alloc(fn->vcount*sizeof(var_t) + 
                         fn->fcount*sizeof(fn_t *), eh);
 
-    tbl_for_begin (k, v, vars) {
-        fn->vars[getraw(v)] = k;
-    } tbl_for_end;
+    // string constants are interned or inline by the parser so
+    // functions don't keep any part of their source alive
+    int i;
+
+    for (i = 0; i < fn->vcount; i++) {
+        fn->vars[i] = vars->vars[i];
+        var_inc(fn->vars[i]);
+    }
 
-    int i = 0;
     fn->fns = (fn_t**)&fn->vars[fn->vcount];
 
-    tbl_for_begin (k, v, fns) {
-        fn->fns[i++] = (fn_t*)getraw(v);
-    } tbl_for_end;
-    
-    tbl_dec(vars);
-    tbl_dec(fns);
+    for (i = 0; i < fn->fcount; i++) {
+        fn->fns[i] = fns->fns[i];
+    }
 
     return fn;
 }
 
-
-fn_t *fn_create(tbl_t *args, var_t code, eh_t *eh) {
-    parse_t *p = parse_create(code, eh);
-
+// Only the function, its bytecode, and its constants outlive
+// the parse, everything else is left in the parse's arena
+static void fn_begin(parse_t *p, eh_t *eh) {
     p->fn = ref_alloc(sizeof(fn_t), eh);
     p->fn->ins = 0;
     p->fn->len = 4;
     p->fn->bcode = mu_alloc(p->fn->len, eh);
 
-    p->fn->vars = tbl_create(args ? tbl_len(args) : 0, eh);
-    p->fn->fns = tbl_create(0, eh);
+    p->fn->vars = arena_alloc(&p->arena, sizeof(struct vparse), eh);
+    p->fn->fns = arena_alloc(&p->arena, sizeof(struct fparse), eh);
+    *p->fn->vars = (struct vparse){0};
+    *p->fn->fns = (struct fparse){0};
+}
+
 
-    parse_args(p, args);
-    parse_stmts(p);
-    parse_end(p);
+// The arena of a failed parse is released before passing on the error
+fn_t *fn_create(tbl_t *args, var_t code, eh_t *eh) {
+    parse_t *p = parse_create(code, eh);
+    fn_t *fn;
+
+    mu_try_begin (eh) {
+        p->eh = eh;
+        fn_begin(p, eh);
+
+        parse_args(p, parse_tblargs(p, args));
+        parse_stmts(p);
+        parse_end(p);
 
-    fn_t *fn = fn_realize(p->fn, eh);
+        fn = fn_realize(p->fn, eh);
+    } mu_on_err (err) {
+        parse_destroy(p);
+        mu_err(err, eh);
+    } mu_try_end;
 
     parse_destroy(p);
 
@@ -68,34 +85,29 @@ fn_t *fn_create(tbl_t *args, var_t code, eh_t *eh) {
 
 fn_t *fn_create_expr(tbl_t *args, var_t code, eh_t *eh) {
     parse_t *p = parse_create(code, eh);
+    fn_t *fn;
 
-    p->fn = ref_alloc(sizeof(fn_t), eh);
-    p->fn->ins = 0;
-    p->fn->len = 4;
-    p->fn->bcode = mu_alloc(p->fn->len, eh);
+    mu_try_begin (eh) {
+        p->eh = eh;
+        fn_begin(p, eh);
 
-    p->fn->vars = tbl_create(args ? tbl_len(args) : 0, eh);
-    p->fn->fns = tbl_create(0, eh);
+        parse_args(p, parse_tblargs(p, args));
+        parse_expr(p);
+        parse_end(p);
 
-    parse_args(p, args);
-    parse_expr(p);
-    parse_end(p);
-
-    fn_t *fn = fn_realize(p->fn, eh);
+        fn = fn_realize(p->fn, eh);
+    } mu_on_err (err) {
+        parse_destroy(p);
+        mu_err(err, eh);
+    } mu_try_end;
 
     parse_destroy(p);
 
     return fn;
 }
 
-fn_t *fn_create_nested(tbl_t *args, parse_t *p, eh_t *eh) {
-    p->fn = ref_alloc(sizeof(fn_t), eh);
-    p->fn->ins = 0;
-    p->fn->len = 4;
-    p->fn->bcode = mu_alloc(p->fn->len, eh);
-
-    p->fn->vars = tbl_create(args ? tbl_len(args) : 0, eh);
-    p->fn->fns = tbl_create(0, eh);
+fn_t *fn_create_nested(struct aparse *args, parse_t *p, eh_t *eh) {
+    fn_begin(p, eh);
 
     parse_args(p, args);
     parse_stmt(p);
@@ -122,14 +134,119 @@ void fn_destroy(void *v) {
 }
 
 
+// Creates closures of functions in a scope
+// closures hold references to both the function and scope
+var_t fn_closure(fn_t *fn, tbl_t *scope, eh_t *eh) {
+    cls_t *cls = ref_alloc(sizeof(cls_t), eh);
+    cls->fn = fn;
+    cls->scope = scope;
+
+    fn_inc(fn);
+    tbl_inc(scope);
+
+    return vfn(cls);
+}
+
+var_t fn_sclosure(sfn_t *sfn, tbl_t *scope, eh_t *eh) {
+    cls_t *cls = ref_alloc(sizeof(cls_t), eh);
+    cls->sfn = sfn;
+    cls->scope = scope;
+
+    tbl_inc(scope);
+
+    return vsfn(cls);
+}
+
+// Called by garbage collector to clean up closures
+void cls_destroy(void *m) {
+    cls_t *cls = m;
+
+    fn_dec(cls->fn);
+    if (cls->scope)
+        tbl_dec(cls->scope);
+    ref_dealloc(m, sizeof(cls_t));
+}
+
+void scls_destroy(void *m) {
+    cls_t *cls = m;
+
+    if (cls->scope)
+        tbl_dec(cls->scope);
+    ref_dealloc(m, sizeof(cls_t));
+}
+
+// Called by the cycle collector, cleared closures
+// are left without a scope until they are destroyed
+void cls_visit(var_t v, void (*visit)(var_t)) {
+    cls_t *cls = getcls(v);
+
+    if (cls->scope)
+        visit(vtbl(cls->scope));
+}
+
+void cls_clear(var_t v) {
+    cls_t *cls = getcls(v);
+
+    if (cls->scope) {
+        tbl_t *scope = cls->scope;
+        cls->scope = 0;
+        tbl_dec(scope);
+    }
+}
+
+
+// Closures are compared by their function and scope, so
+// closures created separately in a scope are equivalent
+bool fn_equals(var_t a, var_t b) {
+    return a.bits == b.bits ||
+           (getcls(a)->fn == getcls(b)->fn &&
+            getscope(a) == getscope(b));
+}
+
+hash_t fn_hash(var_t v) {
+    uintptr_t fn = (uintptr_t)getcls(v)->fn;
+    uintptr_t scope = (uintptr_t)getscope(v);
+    uint64_t bits = fn ^ ((uint64_t)scope << 16);
+    return bits ^ (bits >> 32);
+}
+
+int fn_compare(var_t a, var_t b) {
+    uintptr_t x = (uintptr_t)getcls(a)->fn;
+    uintptr_t y = (uintptr_t)getcls(b)->fn;
+
+    if (x == y) {
+        x = (uintptr_t)getscope(a);
+        y = (uintptr_t)getscope(b);
+    }
+
+    return (x > y) - (x < y);
+}
+
+
 // Call a function. Each function takes a table
 // of arguments, and returns a single variable.
+// The scope of the call is released on return, living
+// on only if captured by closures created in the call
 var_t fn_call(fn_t *fn, tbl_t *args, tbl_t *closure, eh_t *eh) {
     tbl_t *scope = tbl_create(1, eh);
+    tbl_inc(args);
     tbl_insert(scope, vcstr("args"), vtbl(args), eh);
-    scope->tail = closure;
-
-    return mu_exec(fn, args, scope, eh);
+    tbl_inc(closure);
+    tbl_settail(scope, closure);
+
+    // the scope holds the arguments and closure, so releasing
+    // it on errors drops every reference taken for the call
+    var_t ret;
+
+    mu_try_begin (eh) {
+        ret = mu_exec(fn, args, scope, eh);
+    } mu_on_err (err) {
+        tbl_dec(scope);
+        mu_err(err, eh);
+    } mu_try_end;
+
+    tbl_dec(scope);
+    return ret;
 }
 
 var_t fn_call_in(fn_t *fn, tbl_t *args, tbl_t *scope, eh_t *eh) {
@@ -139,17 +256,19 @@ var_t fn_call_in(fn_t *fn, tbl_t *args, tbl_t *scope, eh_t *eh) {
 
 // Returns a string representation of a function
 var_t fn_repr(var_t v, eh_t *eh) {
-    uint32_t bits = (uint32_t)getfn(v);
-    mstr_t *out = str_create(13, eh);
+    uintptr_t bits = type(v) == MU_BFN ? (uintptr_t)getbfn(v) :
+                                         (uintptr_t)getcls(v)->fn;
+    int digits = 2*sizeof bits;
+    mstr_t *out = str_create(5 + digits, eh);
     mstr_t *res = out;
     int i;
 
     memcpy(res, "fn 0x", 5);
     res += 5;
 
-    for (i = 0; i < 8; i++) {
-        *res++ = num_ascii(0xf & (bits >> (8*(4-i))));
+    for (i = 0; i < digits; i++) {
+        *res++ = num_ascii(0xf & (bits >> (4*(digits-1-i))));
     }
 
-    return vstr(out, 0, 13);
+    return vstr(out);
 }
@@ -25,6 +25,17 @@ typedef mu_fn var_t sfn_t(tbl_t *args, tbl_t *scope, eh_t *eh);
 // Definition of Mu function type
 typedef struct fn fn_t;
 
+// Closures pair a function with the scope it was created in,
+// vars of functions with scopes reference their closure
+typedef struct cls {
+    union {
+        struct fn *fn;
+        sfn_t *sfn;
+    };
+
+    tbl_t *scope;
+} cls_t;
+
 
 #endif
 #else
@@ -41,8 +52,8 @@ typedef struct fn fn_t;
 typedef struct fn {
     const str_t *bcode; // function bytecode
 
+    tlen_t bcount;  // length of bytecode
     len_t stack;    // amount of stack usage
-    len_t bcount;   // length of bytecode
     len_t fcount;   // number of stored functions
     len_t vcount;   // number of stored vars
 
@@ -56,13 +67,34 @@ typedef struct fn {
 // which is used as its handle in a var
 fn_t *fn_create(tbl_t *args, var_t code, eh_t *eh);
 fn_t *fn_create_expr(tbl_t *args, var_t code, eh_t *eh);
-fn_t *fn_create_nested(tbl_t *args, parse_t *p, eh_t *eh);
+fn_t *fn_create_nested(struct aparse *args, parse_t *p, eh_t *eh);
 
 // Called by garbage collector to clean up
 void fn_destroy(void *);
 
+// Creates closures of functions in a scope
+var_t fn_closure(fn_t *, tbl_t *scope, eh_t *eh);
+var_t fn_sclosure(sfn_t *, tbl_t *scope, eh_t *eh);
+
+// Called by garbage collector to clean up closures
+void cls_destroy(void *);
+void scls_destroy(void *);
+
+// Called by the cycle collector to visit the scope held
+// by a closure and to release it
+void cls_visit(var_t v, void (*visit)(var_t));
+void cls_clear(var_t v);
+
+// Returns true if both functions are the same function
+// in the same scope
+bool fn_equals(var_t a, var_t b);
+hash_t fn_hash(var_t v);
+int fn_compare(var_t a, var_t b);
+
 // Call a function. Each function takes a table
 // of arguments, and returns a single variable.
+// The arguments are borrowed for the call and the
+// returned variable holds a reference for the caller.
 var_t fn_call(fn_t *, tbl_t *args, tbl_t *scope, eh_t *eh);
 var_t fn_call_in(fn_t *, tbl_t *args, tbl_t *scope, eh_t *eh);
 
@@ -0,0 +1,290 @@
+#include "gc.h"
+
+#include "var.h"
+#include "tbl.h"
+#include "fn.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+// Cycle collection by trial deletion, as described by Bacon and
+// Rajan. The references held inside the graph reachable from the
+// buffered roots are subtracted from the counts in the graph.
+// Anything left with a count is referenced from outside the graph,
+// so its references are restored along with everything it reaches.
+// What remains is only referenced by garbage and is released.
+#define GC_BLACK 0x00000000 // in use
+#define GC_GRAY  0x20000000 // possible member of a garbage cycle
+#define GC_WHITE 0x40000000 // member of a garbage cycle
+
+// Buffered objects reaching zero among this many of the
+// most recent roots are freed immediately
+#define GC_WINDOW 8
+
+// Buffers of vars are kept outside of Mu's heap, since roots
+// are buffered by decrements which can't handle errors
+struct gcbuf {
+    var_t *vars;
+    size_t len;
+    size_t cap;
+};
+
+static struct gcbuf roots;
+static struct gcbuf work;
+static struct gcbuf garbage;
+
+static size_t threshold = MU_GCMIN;
+
+static bool gcbuf_push(struct gcbuf *b, var_t v) {
+    if (b->len == b->cap) {
+        size_t cap = b->cap ? 2*b->cap : 64;
+        var_t *vars = realloc(b->vars, cap*sizeof(var_t));
+
+        if (!vars)
+            return false;
+
+        b->vars = vars;
+        b->cap = cap;
+    }
+
+    b->vars[b->len++] = v;
+    return true;
+}
+
+// A collection can't be abandoned once counts are modified
+static void gc_push(struct gcbuf *b, var_t v) {
+    if (!gcbuf_push(b, v))
+        abort();
+}
+
+mu_inline var_t gc_pop(struct gcbuf *b) {
+    return b->vars[--b->len];
+}
+
+
+// Only counted tables and closures take part in collection,
+// strings and functions can't reference anything that could
+// lead back to them
+mu_inline bool gc_counted(var_t v) {
+    return hasref(v) && type(v) != MU_STR && *getref(v) != 0;
+}
+
+mu_inline ref_t gc_color(var_t v) {
+    return *getref(v) & MU_REFCOLOR;
+}
+
+mu_inline void gc_paint(var_t v, ref_t color) {
+    ref_t *ref = getref(v);
+    *ref = (*ref & ~MU_REFCOLOR) | color;
+}
+
+static void gc_destroy(var_t v) {
+    static void (* const dtors[8])(void *) = {
+        0, 0, 0, scls_destroy,
+        tbl_destroy, tbl_destroy, 0, cls_destroy
+    };
+
+    ref_t *ref = getref(v);
+    *ref = 0;
+    dtors[type(v)](ref + 1);
+}
+
+
+// Buffering of possible roots
+void gc_root(ref_t *ref, enum type type) {
+    if (gcbuf_push(&roots, vptr(ref + 1, type)))
+        *ref |= MU_REFBUF;
+}
+
+void gc_release(ref_t *ref, void (*dtor)(void *)) {
+    size_t i;
+
+    for (i = roots.len; i > 0 && i + GC_WINDOW > roots.len; i--) {
+        if (getref(roots.vars[i-1]) == ref) {
+            memmove(&roots.vars[i-1], &roots.vars[i],
+                    (roots.len - i) * sizeof(var_t));
+            roots.len--;
+
+            *ref = 0;
+            dtor(ref + 1);
+            return;
+        }
+    }
+}
+
+
+// Subtracts the references inside the graph of a root
+static void gc_grayref(var_t v) {
+    if (gc_counted(v)) {
+        (*getref(v))--;
+
+        if (gc_color(v) != GC_GRAY)
+            gc_push(&work, v);
+    }
+}
+
+static void gc_markgray(var_t v) {
+    gc_push(&work, v);
+
+    while (work.len > 0) {
+        v = gc_pop(&work);
+
+        if (gc_color(v) != GC_GRAY) {
+            gc_paint(v, GC_GRAY);
+            var_visit(v, gc_grayref);
+        }
+    }
+}
+
+// Restores the references of anything still in use
+static void gc_blackref(var_t v) {
+    if (gc_counted(v)) {
+        (*getref(v))++;
+
+        if (gc_color(v) != GC_BLACK) {
+            gc_paint(v, GC_BLACK);
+            gc_push(&work, v);
+        }
+    }
+}
+
+static void gc_scanblack(var_t v) {
+    size_t base = work.len;
+    gc_paint(v, GC_BLACK);
+    gc_push(&work, v);
+
+    while (work.len > base)
+        var_visit(gc_pop(&work), gc_blackref);
+}
+
+static void gc_scanref(var_t v) {
+    if (gc_counted(v))
+        gc_push(&work, v);
+}
+
+static void gc_scan(var_t v) {
+    gc_push(&work, v);
+
+    while (work.len > 0) {
+        v = gc_pop(&work);
+
+        if (gc_color(v) != GC_GRAY)
+            continue;
+
+        if (*getref(v) & MU_REFCOUNT) {
+            gc_scanblack(v);
+        } else {
+            gc_paint(v, GC_WHITE);
+            var_visit(v, gc_scanref);
+        }
+    }
+}
+
+// Gathers garbage left white
+static void gc_whiteref(var_t v) {
+    if (gc_counted(v) && gc_color(v) == GC_WHITE) {
+        gc_paint(v, GC_BLACK);
+        gc_push(&work, v);
+        gc_push(&garbage, v);
+    }
+}
+
+static void gc_collectwhite(var_t v) {
+    gc_whiteref(v);
+
+    while (work.len > 0)
+        var_visit(gc_pop(&work), gc_whiteref);
+}
+
+// Garbage is held and marked as buffered so none of it is freed
+// early, its references are restored, and each object is cleared
+// and freed once emptied
+static void gc_restoreref(var_t v) {
+    if (gc_counted(v))
+        (*getref(v))++;
+}
+
+static void gc_free(void) {
+    size_t i;
+
+    for (i = 0; i < garbage.len; i++) {
+        ref_t *ref = getref(garbage.vars[i]);
+        *ref = ((*ref & MU_REFCOUNT) + 1) | MU_REFBUF;
+    }
+
+    for (i = 0; i < garbage.len; i++)
+        var_visit(garbage.vars[i], gc_restoreref);
+
+    for (i = 0; i < garbage.len; i++)
+        var_clear(garbage.vars[i]);
+
+    for (i = 0; i < garbage.len; i++) {
+        ref_t *ref = getref(garbage.vars[i]);
+
+        if ((*ref & MU_REFCOUNT) == 1)
+            gc_destroy(garbage.vars[i]);
+        else
+            *ref = (*ref & MU_REFCOUNT) - 1;
+    }
+
+    garbage.len = 0;
+}
+
+
+// Frees garbage cycles among the buffered roots
+void gc_collect(void) {
+    struct gcbuf cands = roots;
+    roots = (struct gcbuf){0};
+    size_t i, n;
+    bool freed;
+
+    // roots which died while buffered are freed first, which
+    // may leave other roots dead in turn. Objects left alive by
+    // these frees are buffered as roots, and join the candidates
+    // since this collection may find them to be garbage
+    do {
+        freed = false;
+
+        for (i = 0, n = 0; i < cands.len; i++) {
+            if (*getref(cands.vars[i]) & MU_REFCOUNT) {
+                cands.vars[n++] = cands.vars[i];
+            } else {
+                gc_destroy(cands.vars[i]);
+                freed = true;
+            }
+        }
+
+        cands.len = n;
+
+        for (i = 0; i < roots.len; i++)
+            gc_push(&cands, roots.vars[i]);
+
+        roots.len = 0;
+    } while (freed);
+
+    for (i = 0; i < cands.len; i++)
+        gc_markgray(cands.vars[i]);
+
+    for (i = 0; i < cands.len; i++)
+        gc_scan(cands.vars[i]);
+
+    for (i = 0; i < cands.len; i++)
+        *getref(cands.vars[i]) &= ~MU_REFBUF;
+
+    for (i = 0; i < cands.len; i++)
+        gc_collectwhite(cands.vars[i]);
+
+    gc_free();
+    free(cands.vars);
+
+    threshold = 2*mu_inuse();
+
+    if (threshold < MU_GCMIN)
+        threshold = MU_GCMIN;
+}
+
+void gc_poll(void) {
+    if (mu_inuse() >= threshold)
+        gc_collect();
+}
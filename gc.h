@@ -0,0 +1,82 @@
+/*
+ *  Cycle collection
+ */
+
+#ifdef MU_DEF
+#ifndef MU_GC_DEF
+#define MU_GC_DEF
+
+#include "mu.h"
+#include "mem.h"
+
+
+// The top bits of reference counts are reserved for the cycle
+// collector, marking objects buffered as possible roots of
+// garbage cycles and coloring objects during a collection
+#define MU_REFBUF   0x80000000
+#define MU_REFCOLOR 0x60000000
+#define MU_REFCOUNT 0x1fffffff
+
+// Collections are triggered once the memory in use doubles
+// from what was left after the last collection, but never
+// before MU_GCMIN bytes are in use.
+//
+// A collection traces at most the memory in use, and doubling
+// means at least that much was allocated since the last one,
+// so collecting costs a constant factor of allocation however
+// large the heap grows, at the price of holding up to as much
+// garbage as live memory. Small scripts would collect every
+// few allocations, so the 1 MB floor trades a bounded amount
+// of garbage for never collecting when little is allocated.
+#define MU_GCMIN (1024*1024)
+
+
+#endif
+#else
+#ifndef MU_GC_H
+#define MU_GC_H
+#define MU_DEF
+#include "gc.h"
+#include "var.h"
+#undef MU_DEF
+
+#include "mem.h"
+
+
+// Tables and closures may form cycles, so when a decrement
+// leaves one alive it is buffered as a possible root of a
+// garbage cycle. Buffered objects reaching zero are freed
+// by the collector unless they were recently buffered.
+void gc_root(ref_t *ref, enum type type);
+void gc_release(ref_t *ref, void (*dtor)(void *));
+
+mu_inline void gc_dec(void *m, enum type type, void (*dtor)(void *)) {
+    ref_t *ref = ref_get(m);
+
+    if (*ref != 0) {
+        ref_t count = --(*ref);
+
+        if (mu_unlikely(count & MU_REFBUF)) {
+            if (!(count & MU_REFCOUNT))
+                gc_release(ref, dtor);
+        } else if (count == 0) {
+            dtor(ref + 1);
+        } else {
+            gc_root(ref, type);
+        }
+    }
+}
+
+
+// Frees garbage cycles among the buffered roots
+// Only called between instructions, where every reference
+// held outside of the heap is counted
+void gc_collect(void);
+
+// Collects if enough memory has been allocated since
+// the last collection
+void gc_poll(void);
+
+
+#endif
+#endif
@@ -6,6 +6,8 @@
 #include "str.h"
 #include "tbl.h"
 
+#include <string.h>
+
 
 // Creates internal tables for keywords or uses prexisting.
 // Use this to initialize an op table if nescessary.
@@ -92,6 +94,24 @@ static void wskip(parse_t *p) {
 }
 
 
+// Helper function for slicing tokens
+// Short tokens are stored inline and other tokens are
+// copied out of the source and interned for the parse
+static var_t lslice(parse_t *p, const str_t *kw, size_t len) {
+    if (len <= MU_STRINLINE)
+        return vistr(kw, len);
+
+    mstr_t *str = str_create(len, p->eh);
+    memcpy(str, kw, len);
+
+    var_t v = vstr(str);
+    var_t s = parse_intern(p, v);
+    var_dec(v);
+
+    return s;
+}
+
+
 static mu_noreturn void l_bad(parse_t *p) {
     err_parse(p->eh);
 }
@@ -107,14 +127,15 @@ static void l_com(parse_t *p) {
 }
 
 static void l_op(parse_t *p) {
-    const str_t *kw = p->pos++;
+    const str_t *op = p->pos++;
+    const str_t *kw;
 
     while (p->pos < p->end && (lexs[*p->pos] == l_op ||
                                lexs[*p->pos] == l_set)) {
         p->pos++;
     }
 
-    p->val = vstr(p->str, kw-p->str, p->pos-kw);
+    p->val = lslice(p, op, p->pos-op);
 
     kw = p->pos;
     wskip(p);
@@ -126,7 +147,7 @@ static void l_op(parse_t *p) {
         p->tok = T_KEY;
     } else if (p->left && lexs[kw[-1]] == l_set) {
         p->tok = T_OPSET;
-        p->val.len -= 1;
+        p->val = lslice(p, op, kw-op - 1);
     } else {
         p->tok = T_OP;
     }
@@ -140,7 +161,7 @@ static void l_kw(parse_t *p) {
         p->pos++;
     }
 
-    p->val = vstr(p->str, kw-p->str, p->pos-kw);
+    p->val = lslice(p, kw, p->pos-kw);
     var_t tok = tbl_lookup(p->keys, p->val);
 
     kw = p->pos;
@@ -188,8 +209,11 @@ static void l_num(parse_t *p) {
 }
 
 static void l_str(parse_t *p) {
+    var_t lit = str_parse(&p->pos, p->end, p->eh);
+
     p->tok = T_LIT;
-    p->val = str_parse(&p->pos, p->end, p->eh);
+    p->val = parse_intern(p, lit);
+    var_dec(lit);
 }
 
 
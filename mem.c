@@ -5,55 +5,222 @@
 #include <string.h>
 
 
+// Small blocks are allocated from slabs by size class. Each
+// class keeps a list of freed blocks, linked through the blocks
+// themselves, and the unused remainder of its current slab.
+// Slabs are never returned, freed blocks are only reused by
+// later allocations of the same class.
+#define MU_SLABCLASSES (MU_SLABMAX / 8)
+
+struct block {
+    struct block *next;
+};
+
+static struct slabclass {
+    struct block *free; // freed blocks of this class
+    uint8_t *pos;       // next unused block in current slab
+    uint8_t *end;       // end of current slab
+} slabs[MU_SLABCLASSES];
+
+mu_inline struct slabclass *slab_class(size_t size) {
+    return &slabs[(size-1) / 8];
+}
+
+mu_inline size_t slab_size(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+static void *slab_alloc(size_t size, eh_t *eh) {
+    struct slabclass *c = slab_class(size);
+
+    if (c->free) {
+        struct block *b = c->free;
+        c->free = b->next;
+        return b;
+    }
+
+    size = slab_size(size);
+
+    if ((size_t)(c->end - c->pos) < size) {
+        // slabs are aligned to cache lines so blocks of
+        // 64 bytes each fill a single line
+        c->pos = aligned_alloc(64, MU_SLABSIZE);
+
+        if (c->pos == 0)
+            err_nomem(eh);
+
+        c->end = c->pos + MU_SLABSIZE;
+    }
+
+    void *m = c->pos;
+    c->pos += size;
+    return m;
+}
+
+static void slab_dealloc(void *m, size_t size) {
+    struct slabclass *c = slab_class(size);
+    struct block *b = m;
+
+    b->next = c->free;
+    c->free = b;
+}
+
+
+// Bytes currently allocated
+static size_t inuse = 0;
+
+size_t mu_inuse(void) {
+    return inuse;
+}
+
+
 // Manual memory management
-// Currently just a wrapper over malloc and free
 // Garuntees 8 byte alignment
 void *mu_alloc(size_t size, eh_t *eh) {
     void *m;
-    
+
     if (size == 0)
         return 0;
 
-    m = (void *)malloc(size);
+    if (size <= MU_SLABMAX) {
+        m = slab_alloc(size, eh);
+    } else {
+        m = malloc(size);
+
+        if (m == 0)
+            err_nomem(eh);
+    }
 
-    if (m == 0)
-        err_nomem(eh);
+    inuse += size;
 
-    mu_assert(sizeof m == sizeof(uint32_t)); // garuntee address width
-    mu_assert((0x7 & (uint32_t)m) == 0); // garuntee alignment
+    mu_assert((uintptr_t)m < ((uintptr_t)1 << 47)); // garuntee address width
+    mu_assert((0x7 & (uintptr_t)m) == 0); // garuntee alignment
 
     return m;
 }
 
+// Blocks staying in the same size class are left in place,
+// blocks moving between classes or to malloc are copied
 void *mu_realloc(void *m, size_t prev, size_t size, eh_t *eh) {
-    m = realloc(m, size);
+    if (m == 0 || prev == 0)
+        return mu_alloc(size, eh);
 
-    if (m == 0)
-        err_nomem(eh);
+    if (size == 0) {
+        mu_dealloc(m, prev);
+        return 0;
+    }
 
-    mu_assert(sizeof m == sizeof(uint32_t)); // garuntee address width
-    mu_assert((0x7 & (uint32_t)m) == 0); // garuntee alignment
+    if (prev > MU_SLABMAX && size > MU_SLABMAX) {
+        m = realloc(m, size);
+
+        if (m == 0)
+            err_nomem(eh);
+
+        inuse += size - prev;
+    } else if (prev > MU_SLABMAX || size > MU_SLABMAX ||
+               slab_class(prev) != slab_class(size)) {
+        void *n = mu_alloc(size, eh);
+        memcpy(n, m, prev < size ? prev : size);
+        mu_dealloc(m, prev);
+        m = n;
+    } else {
+        inuse += size - prev;
+    }
+
+    mu_assert((uintptr_t)m < ((uintptr_t)1 << 47)); // garuntee address width
+    mu_assert((0x7 & (uintptr_t)m) == 0); // garuntee alignment
 
     return m;
 }
 
+// The size must match the size the block was allocated with
 void mu_dealloc(void *m, size_t size) {
-//    free(m);
+    if (m == 0 || size == 0)
+        return;
+
+    inuse -= size;
+
+    if (size <= MU_SLABMAX)
+        slab_dealloc(m, size);
+    else
+        free(m);
+}
+
+
+// Arena allocation for short lived memory
+// Chunks are linked through a header which also holds
+// the size each chunk was allocated with
+struct chunk {
+    struct chunk *next;
+    size_t size;
+};
+
+void *arena_alloc(arena_t *a, size_t size, eh_t *eh) {
+    size = slab_size(size);
+
+    if ((size_t)(a->end - a->pos) < size) {
+        size_t csize = sizeof(struct chunk) +
+                       (size > MU_ARENASIZE ? size : MU_ARENASIZE);
+        struct chunk *c = mu_alloc(csize, eh);
+        c->next = a->chunks;
+        c->size = csize;
+
+        a->chunks = c;
+        a->pos = (uint8_t *)(c + 1);
+        a->end = (uint8_t *)c + csize;
+    }
+
+    void *m = a->pos;
+    a->pos += size;
+    return m;
+}
+
+// The most recent block grows in place when it fits,
+// otherwise the old block is simply abandoned
+void *arena_realloc(arena_t *a, void *m, size_t prev, size_t size, eh_t *eh) {
+    prev = slab_size(prev);
+
+    if (m && (uint8_t *)m + prev == a->pos &&
+        (size_t)(a->end - (uint8_t *)m) >= size) {
+        a->pos = (uint8_t *)m + slab_size(size);
+        return m;
+    }
+
+    void *n = arena_alloc(a, size, eh);
+
+    if (m)
+        memcpy(n, m, prev < size ? prev : size);
+
+    return n;
+}
+
+void arena_destroy(arena_t *a) {
+    struct chunk *c = a->chunks;
+
+    while (c) {
+        struct chunk *next = c->next;
+        mu_dealloc(c, c->size);
+        c = next;
+    }
+
+    *a = (arena_t){0};
 }
 
 
 // Garbage collected memory based on reference counting
 // Each block of memory prefixed with ref_t reference
 // count. Deallocated immediately when ref hits zero.
-// It is up to the user to avoid cyclic dependencies.
+// Cycles of tables and closures are left to gc.c.
 void *ref_alloc(size_t size, eh_t *eh) {
-    ref_t *m = mu_alloc(sizeof(ref_t) + size, eh);
+    uint8_t *m = mu_alloc(MU_REFHEAD + size, eh);
+    ref_t *ref = (ref_t *)(m + MU_REFHEAD) - 1;
 
     // start with a count of 1
-    *m = 1;
-    return m + 1;
+    *ref = 1;
+    return ref + 1;
 }
 
+// Takes the same pointer returned by ref_alloc
 void ref_dealloc(void *m, size_t size) {
-    mu_dealloc(m, sizeof(ref_t) + size);
+    mu_dealloc((uint8_t *)m - MU_REFHEAD, MU_REFHEAD + size);
 }
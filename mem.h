@@ -9,8 +9,27 @@
 #include "mu.h"
 
 
-// Reference type as word type aligned to 8 bytes
-typedef mu_aligned unsigned int ref_t;
+// Reference counts are stored in the last word of a header
+// before each counted object, keeping objects 8 byte aligned
+typedef uint32_t ref_t;
+
+#define MU_REFHEAD 8
+
+// Allocations up to MU_SLABMAX bytes are rounded up to a
+// multiple of 8 and carved out of slabs of MU_SLABSIZE bytes
+// shared by blocks of the same size class
+#define MU_SLABMAX 512
+#define MU_SLABSIZE (64*1024)
+
+// Arenas bump allocate blocks out of chunks of at least
+// MU_ARENASIZE bytes, which are all freed with the arena
+#define MU_ARENASIZE (4*1024)
+
+typedef struct arena {
+    struct chunk *chunks;
+    uint8_t *pos;
+    uint8_t *end;
+} arena_t;
 
 
 #endif
@@ -26,31 +45,49 @@ typedef mu_aligned unsigned int ref_t;
 
 
 // Manual memory management
-// simple wrapper over malloc and free if available
+// small blocks come from per size class free lists
+// and larger blocks are passed on to malloc and free
 // returns 0 when size == 0
 void *mu_alloc(size_t size, eh_t *eh);
 void *mu_realloc(void *, size_t prev, size_t size, eh_t *eh);
 void mu_dealloc(void *, size_t size);
 
+// Returns the bytes currently allocated
+size_t mu_inuse(void);
+
+
+// Arena allocation for short lived memory
+// blocks are not freed individually, destroying the
+// arena frees every block allocated from it at once
+void *arena_alloc(arena_t *, size_t size, eh_t *eh);
+void *arena_realloc(arena_t *, void *, size_t prev, size_t size, eh_t *eh);
+void arena_destroy(arena_t *);
+
 
 // Garbage collected memory based on reference counting
 // Each block of memory prefixed with ref_t reference
 // count. Deallocated immediately when ref hits zero.
-// It is up to the user to avoid cyclic dependencies.
+// Cycles of tables and closures are left to gc.c.
 void *ref_alloc(size_t size, eh_t *eh);
 
 void ref_dealloc(void *m, size_t size);
 
+// Finds the reference count of an object from a pointer
+// into its first 8 bytes, such as a pointer tagged with a type
+mu_inline ref_t *ref_get(const void *m) {
+    return (ref_t *)(~0x7 & (uintptr_t)m) - 1;
+}
+
 
 mu_inline void ref_inc(void *m) {
-    ref_t *ref = (ref_t*)(~0x7 & (uint32_t)m);
+    ref_t *ref = ref_get(m);
 
     if (*ref != 0)
         (*ref)++;
 }
 
 mu_inline void ref_dec(void *m, void (*dtor)(void*)) {
-    ref_t *ref = (ref_t*)(~0x7 & (uint32_t)m);
+    ref_t *ref = ref_get(m);
 
     if (*ref != 0)
         if (--(*ref) == 0)
@@ -7,8 +7,11 @@
 #include "var.h"
 #include "fn.h"
 #include "tbl.h"
+#include "num.h"
 #include "str.h"
 #include "string.h"
+#include <math.h>
+#include <time.h>
 
 #define PROMPT_A "\033[32m> \033[0m"
 #define PROMPT_B "\033[32m. \033[0m"
@@ -28,20 +31,22 @@ static bool do_stdin = false;
 static bool do_default = true;
 
 
+// Representations are released once printed,
+// strings are borrowed and printed as is
 static void printvar(var_t v, eh_t *eh) {
-    var_t out;
-
     if (isstr(v)) {
-        out = v;
+        printf("%.*s", getlen(v), getstr(&v));
     } else {
-        out = var_repr(v, eh);
+        var_t out = var_repr(v, eh);
+        printf("%.*s", getlen(out), getstr(&out));
+        var_dec(out);
     }
-
-    printf("%.*s", getlen(out), getstr(out));
 }
 
 static void printrepr(var_t v, eh_t *eh) {
-    printvar(var_repr(v, eh), eh);
+    var_t out = var_repr(v, eh);
+    printf("%.*s", getlen(out), getstr(&out));
+    var_dec(out);
 }
 
 static void printerr(tbl_t *err) {
@@ -77,22 +82,337 @@ static len_t prompt(mstr_t *input) {
 
 
 // TODO move this scope declaration somewhere else
+// integers that overflow are promoted to doubles
 static mu_fn var_t b_add(tbl_t *args, eh_t *eh) {
-    return vnum(getnum(tbl_lookup(args, vnum(0))) +
-                getnum(tbl_lookup(args, vnum(1))));
+    var_t a = tbl_lookup(args, vnum(0));
+    var_t b = tbl_lookup(args, vnum(1));
+    int32_t i;
+
+    if (isint(a) && isint(b) &&
+        !__builtin_add_overflow(getint(a), getint(b), &i))
+        return vint(i);
+
+    return vnum(getnum(a) + getnum(b));
 }
 
 static mu_fn var_t b_sub(tbl_t *args, eh_t *eh) {
-    return vnum(getnum(tbl_lookup(args, vnum(0))) -
-                getnum(tbl_lookup(args, vnum(1))));
+    var_t a = tbl_lookup(args, vnum(0));
+    var_t b = tbl_lookup(args, vnum(1));
+    int32_t i;
+
+    if (isint(a) && isint(b) &&
+        !__builtin_sub_overflow(getint(a), getint(b), &i))
+        return vint(i);
+
+    return vnum(getnum(a) - getnum(b));
+}
+
+static tbl_t *argtbl(tbl_t *args, int i, eh_t *eh) {
+    var_t v = tbl_lookup(args, vnum(i));
+
+    if (!istbl(v))
+        err_undefined(eh);
+
+    return gettbl(v);
+}
+
+static tlen_t count(num_t start, num_t stop, num_t step, eh_t *eh) {
+    if (step == 0)
+        err_undefined(eh);
+
+    num_t len = ceil((stop - start) / step);
+
+    if (len > MU_MAXTLEN)
+        err_len(eh);
+
+    return len > 0 ? len : 0;
+}
+
+static int clamp(num_t i, int lo, int hi) {
+    return i < lo ? lo : i > hi ? hi : i;
+}
+
+// Ranges and slices are stored with 32 bit integer offsets
+// and steps, so other numbers can't be represented
+static var_t intarg(var_t v, eh_t *eh) {
+    if (!isnil(v) && !isint(v))
+        err_undefined(eh);
+
+    return v;
+}
+
+static mu_fn var_t b_range(tbl_t *args, eh_t *eh) {
+    var_t start = tbl_lookup(args, vnum(0));
+    var_t stop = tbl_lookup(args, vnum(1));
+    var_t step = tbl_lookup(args, vnum(2));
+
+    if (isnil(stop)) {
+        stop = start;
+        start = vnum(0);
+    }
+
+    int offset = getint(intarg(start, eh));
+    int inc = isnil(step) ? 1 : getint(intarg(step, eh));
+    tlen_t len = count(offset, getnum(stop), inc, eh);
+
+    return vtbl(tbl_range(offset, inc, len, eh));
+}
+
+static mu_fn var_t b_slice(tbl_t *args, eh_t *eh) {
+    tbl_t *t = argtbl(args, 0, eh);
+    var_t start = tbl_lookup(args, vnum(1));
+    var_t stop = tbl_lookup(args, vnum(2));
+    var_t step = tbl_lookup(args, vnum(3));
+
+    int inc = isnil(step) ? 1 : getint(intarg(step, eh));
+    int lo = inc > 0 ? 0 : -1;
+    int hi = inc > 0 ? tbl_len(t) : tbl_len(t)-1;
+
+    int offset = isnil(start) ? (inc > 0 ? lo : hi) : clamp(getnum(start), lo, hi);
+    int end = isnil(stop) ? (inc > 0 ? hi : lo) : clamp(getnum(stop), lo, hi);
+    tlen_t len = count(offset, end, inc, eh);
+
+    return vtbl(tbl_slice(t, offset, inc, len, eh));
+}
+
+// Numeric builtins work on packed copies of lists that are not
+// already packed, arguments are never modified or converted and
+// scale and axpy return new lists
+static mu_fn var_t b_sum(tbl_t *args, eh_t *eh) {
+    tbl_t *x = tbl_packed(argtbl(args, 0, eh), eh);
+    num_t res = num_sum(tbl_nums(x), tbl_len(x));
+
+    tbl_dec(x);
+    return vnum(res);
+}
+
+static mu_fn var_t b_min(tbl_t *args, eh_t *eh) {
+    tbl_t *x = tbl_packed(argtbl(args, 0, eh), eh);
+    var_t res = vnil;
+
+    if (tbl_len(x) > 0)
+        res = vnum(num_min(tbl_nums(x), tbl_len(x)));
+
+    tbl_dec(x);
+    return res;
+}
+
+static mu_fn var_t b_max(tbl_t *args, eh_t *eh) {
+    tbl_t *x = tbl_packed(argtbl(args, 0, eh), eh);
+    var_t res = vnil;
+
+    if (tbl_len(x) > 0)
+        res = vnum(num_max(tbl_nums(x), tbl_len(x)));
+
+    tbl_dec(x);
+    return res;
+}
+
+// Lists of different lengths are combined over the shorter length
+static mu_fn var_t b_dot(tbl_t *args, eh_t *eh) {
+    tbl_t *x = argtbl(args, 0, eh);
+    tbl_t *y = argtbl(args, 1, eh);
+    x = tbl_packed(x, eh);
+    y = tbl_packed(y, eh);
+    tlen_t len = tbl_len(x) < tbl_len(y) ? tbl_len(x) : tbl_len(y);
+    num_t res = num_dot(tbl_nums(x), tbl_nums(y), len);
+
+    tbl_dec(x);
+    tbl_dec(y);
+    return vnum(res);
+}
+
+static mu_fn var_t b_scale(tbl_t *args, eh_t *eh) {
+    tbl_t *x = tbl_packcopy(argtbl(args, 0, eh), eh);
+    num_t s = getnum(tbl_lookup(args, vnum(1)));
+
+    num_scale(tbl_nums(x), s, tbl_len(x));
+    return vtbl(x);
+}
+
+// Entries of y past the end of x are copied unchanged
+static mu_fn var_t b_axpy(tbl_t *args, eh_t *eh) {
+    num_t s = getnum(tbl_lookup(args, vnum(0)));
+    tbl_t *x = argtbl(args, 1, eh);
+    tbl_t *y = argtbl(args, 2, eh);
+    x = tbl_packed(x, eh);
+    y = tbl_packcopy(y, eh);
+    tlen_t len = tbl_len(x) < tbl_len(y) ? tbl_len(x) : tbl_len(y);
+
+    num_axpy(s, tbl_nums(x), tbl_nums(y), len);
+    tbl_dec(x);
+    return vtbl(y);
+}
+
+static mu_fn var_t b_lookup(tbl_t *args, eh_t *eh) {
+    tbl_t *t = argtbl(args, 0, eh);
+    tbl_t *ks = argtbl(args, 1, eh);
+    tlen_t i, len = tbl_len(ks);
+
+    var_t *keys = mu_alloc(2*len * sizeof(var_t), eh);
+    var_t *vals = keys + len;
+
+    i = 0;
+    tbl_for_begin (k, v, ks) {
+        keys[i++] = v;
+    } tbl_for_end;
+
+    tbl_lookup_many(t, keys, vals, len);
+
+    tbl_t *res = tbl_create(len, eh);
+
+    for (i=0; i < len; i++) {
+        var_inc(vals[i]);
+        tbl_insert(res, vnum(i), vals[i], eh);
+    }
+
+    mu_dealloc(keys, 2*len * sizeof(var_t));
+    return vtbl(res);
+}
+
+static mu_fn var_t b_persist(tbl_t *args, eh_t *eh) {
+    var_t t = tbl_lookup(args, vnum(0));
+
+    if (isnil(t)) {
+        tbl_t *empty = tbl_create(0, eh);
+        tbl_t *res = tbl_persist(empty, eh);
+        tbl_dec(empty);
+        return vtbl(res);
+    }
+
+    if (!istbl(t))
+        err_undefined(eh);
+
+    return vtbl(tbl_persist(gettbl(t), eh));
+}
+
+static mu_fn var_t b_with(tbl_t *args, eh_t *eh) {
+    tbl_t *t = argtbl(args, 0, eh);
+    var_t key = tbl_lookup(args, vnum(1));
+    var_t val = tbl_lookup(args, vnum(2));
+
+    var_inc(key);
+    var_inc(val);
+    return vtbl(tbl_with(t, key, val, eh));
+}
+
+static mu_fn var_t b_sorted(tbl_t *args, eh_t *eh) {
+    var_t t = tbl_lookup(args, vnum(0));
+
+    if (isnil(t))
+        return vtbl(tbl_sorted(eh));
+
+    if (!istbl(t))
+        err_undefined(eh);
+
+    return vtbl(tbl_between(gettbl(t), vnil, vnil, eh));
+}
+
+static mu_fn var_t b_lower(tbl_t *args, eh_t *eh) {
+    tbl_t *t = argtbl(args, 0, eh);
+    var_t lower = tbl_lower(t, tbl_lookup(args, vnum(1)));
+
+    var_inc(lower);
+    return lower;
+}
+
+static mu_fn var_t b_between(tbl_t *args, eh_t *eh) {
+    tbl_t *t = argtbl(args, 0, eh);
+    var_t lo = tbl_lookup(args, vnum(1));
+    var_t hi = tbl_lookup(args, vnum(2));
+
+    return vtbl(tbl_between(t, lo, hi, eh));
+}
+
+static mu_fn var_t b_intern(tbl_t *args, eh_t *eh) {
+    var_t s = tbl_lookup(args, vnum(0));
+
+    if (!isstr(s))
+        err_undefined(eh);
+
+    return str_intern(s, eh);
+}
+
+// Bytes currently allocated, for watching memory being released
+static mu_fn var_t b_inuse(tbl_t *args, eh_t *eh) {
+    return vnum(mu_inuse());
+}
+
+// Frees any garbage cycles now rather than when memory grows
+static mu_fn var_t b_collect(tbl_t *args, eh_t *eh) {
+    gc_collect();
+    return vnil;
+}
+
+static mu_fn var_t b_num(tbl_t *args, eh_t *eh) {
+    var_t s = tbl_lookup(args, vnum(0));
+
+    if (isnum(s))
+        return s;
+    else if (!isstr(s))
+        err_undefined(eh);
+
+    const str_t *pos = getstr(&s);
+    const str_t *end = getend(&s);
+    bool neg = false;
+
+    if (pos < end && (*pos == '+' || *pos == '-'))
+        neg = *pos++ == '-';
+
+    if (pos == end || num_val(*pos) >= 10)
+        return vnil;
+
+    var_t n = num_parse(&pos, end);
+
+    if (pos != end)
+        return vnil;
+
+    return neg ? vnum(-getnum(n)) : n;
+}
+
+static mu_fn var_t b_join(tbl_t *args, eh_t *eh) {
+    tbl_t *t = argtbl(args, 0, eh);
+    var_t sep = tbl_lookup(args, vnum(1));
+    bool first = true;
+    strb_t b;
+
+    if (!isnil(sep) && !isstr(sep))
+        err_undefined(eh);
+
+    strb_init(&b, 0, eh);
+
+    tbl_for_begin (k, v, t) {
+        if (!first && !isnil(sep))
+            strb_append(&b, sep, eh);
+
+        if (isstr(v))
+            strb_append(&b, v, eh);
+        else
+            var_reprb(v, &b, eh);
+
+        first = false;
+    } tbl_for_end;
+
+    return strb_finish(&b, eh);
 }
 
 static mu_fn var_t b_print(tbl_t *args, eh_t *eh) {
+    strb_t b;
+    strb_init(&b, 0, eh);
+
     tbl_for_begin (k, v, args) {
-        printvar(v, eh);
+        if (isstr(v))
+            strb_append(&b, v, eh);
+        else
+            var_reprb(v, &b, eh);
     } tbl_for_end;
 
-    printf("\n");
+    strb_append(&b, vcstr("\n"), eh);
+
+    var_t out = strb_finish(&b, eh);
+    fwrite(getstr(&out), 1, getlen(out), stdout);
+    var_dec(out);
+
     return vnil;
 }
 
@@ -103,6 +423,25 @@ static void genscope(eh_t *eh) {
     tbl_assign(ops, vcstr("+"), vbfn(b_add), eh);
     tbl_assign(ops, vcstr("-"), vbfn(b_sub), eh);
     tbl_assign(scope, vcstr("ops"), vtbl(ops), eh);
+    tbl_assign(scope, vcstr("range"), vbfn(b_range), eh);
+    tbl_assign(scope, vcstr("slice"), vbfn(b_slice), eh);
+    tbl_assign(scope, vcstr("sum"), vbfn(b_sum), eh);
+    tbl_assign(scope, vcstr("min"), vbfn(b_min), eh);
+    tbl_assign(scope, vcstr("max"), vbfn(b_max), eh);
+    tbl_assign(scope, vcstr("dot"), vbfn(b_dot), eh);
+    tbl_assign(scope, vcstr("scale"), vbfn(b_scale), eh);
+    tbl_assign(scope, vcstr("axpy"), vbfn(b_axpy), eh);
+    tbl_assign(scope, vcstr("lookup"), vbfn(b_lookup), eh);
+    tbl_assign(scope, vcstr("sorted"), vbfn(b_sorted), eh);
+    tbl_assign(scope, vcstr("persist"), vbfn(b_persist), eh);
+    tbl_assign(scope, vcstr("with"), vbfn(b_with), eh);
+    tbl_assign(scope, vcstr("lower"), vbfn(b_lower), eh);
+    tbl_assign(scope, vcstr("between"), vbfn(b_between), eh);
+    tbl_assign(scope, vcstr("intern"), vbfn(b_intern), eh);
+    tbl_assign(scope, vcstr("inuse"), vbfn(b_inuse), eh);
+    tbl_assign(scope, vcstr("collect"), vbfn(b_collect), eh);
+    tbl_assign(scope, vcstr("num"), vbfn(b_num), eh);
+    tbl_assign(scope, vcstr("join"), vbfn(b_join), eh);
     tbl_assign(scope, vcstr("print"), vbfn(b_print), eh);
 }
 
@@ -110,11 +449,11 @@ static int genargs(int i, int argc, const char **argv, eh_t *eh) {
     args = tbl_create(argc-i, eh);
 
     for (; i < argc; i++) {
-        len_t len = strlen(argv[i]);
+        slen_t len = strlen(argv[i]);
         mstr_t *str = str_create(len, eh);
         memcpy(str, argv[i], len);
 
-        tbl_append(args, vstr(str, 0, len), eh);
+        tbl_append(args, vstr(str), eh);
     }
 
     return i;
@@ -122,35 +461,42 @@ static int genargs(int i, int argc, const char **argv, eh_t *eh) {
 
 
 static void execute(const char *input, eh_t *eh) {
-    len_t len = strlen(input);
+    slen_t len = strlen(input);
     mstr_t *str = str_create(len, eh);
     memcpy(str, input, len);
-    fn_t *f = fn_create(0, vstr(str, 0, len), eh);
 
-    fn_call_in(f, 0, scope, eh);
+    var_t code = vstr(str);
+    fn_t *f = fn_create(0, code, eh);
+    var_dec(code);
+
+    var_dec(fn_call_in(f, 0, scope, eh));
+    fn_dec(f);
 }
 
 static void load_file(FILE *file, eh_t *eh) {
-    mstr_t *buffer = str_create(BUFFER_SIZE, eh);
-    size_t off = 0;
-    size_t len;
+    strb_t b;
+    strb_init(&b, BUFFER_SIZE, eh);
 
-    len = fread(buffer, 1, BUFFER_SIZE, file);
+    while (!feof(file) && !ferror(file)) {
+        mstr_t *buffer = strb_reserve(&b, BUFFER_SIZE, eh);
+        b.len += fread(buffer, 1, BUFFER_SIZE, file);
+    }
 
     if (ferror(file)) {
         mu_cerr(vcstr("io"), vcstr("encountered file reading error"), eh);
     }
 
-    if (!memcmp(buffer, "#!", 2)) {
-        for (off = 2; buffer[off] != '\n'; off++)
-            ;
-        off++;
-    }
+    // the shebang line is turned into a comment so the
+    // source is left whole
+    if (b.len >= 2 && !memcmp(b.str, "#!", 2))
+        b.str[0] = '`';
 
-    var_t code = vstr(buffer, off, len-off);
+    var_t code = strb_finish(&b, eh);
     fn_t *f = fn_create(0, code, eh);
+    var_dec(code);
 
-    fn_call_in(f, 0, scope, eh);
+    var_dec(fn_call_in(f, 0, scope, eh));
+    fn_dec(f);
 }
 
 static void load(const char *name, eh_t *eh) {
@@ -172,14 +518,15 @@ static mu_noreturn int interpret(eh_t *eh) {
         len_t len = prompt(buffer);
         mstr_t *str = str_create(len, eh);
         memcpy(str, buffer, len);
+        var_t code = vstr(str);
         
         mu_try_begin (eh) {
             fn_t *f;
 
             mu_try_begin (eh) {
-                f = fn_create_expr(0, vstr(str, 0, len), eh);
+                f = fn_create_expr(0, code, eh);
             } mu_on_err (err) {
-                f = fn_create(0, vstr(str, 0, len), eh);
+                f = fn_create(0, code, eh);
             } mu_try_end;
 
             var_t output = fn_call_in(f, 0, scope, eh);
@@ -192,6 +539,8 @@ static mu_noreturn int interpret(eh_t *eh) {
         } mu_on_err (err) {
             printerr(err);
         } mu_try_end;
+
+        var_dec(code);
     }
 }
 
@@ -267,10 +616,24 @@ static int options(int i, int argc, const char **argv, eh_t *eh) {
 }
 
 
+static void genseed(void) {
+    uint32_t seed = time(0) ^ (uint32_t)clock();
+    FILE *rand = fopen("/dev/urandom", "rb");
+
+    if (rand) {
+        fread(&seed, sizeof seed, 1, rand);
+        fclose(rand);
+    }
+
+    str_seed(seed);
+}
+
+
 int main(int argc, const char **argv) {
     mu_try_begin (eh) {
         int i = 1;
 
+        genseed();
         genscope(eh);
 
         if ((i = options(i, argc, argv, eh)) < 0) {
@@ -32,9 +32,12 @@
 // Builtin for an unreachable point in code
 #define mu_unreachable() __builtin_unreachable()
 
-// Builtin for the next power of two
+// Builtin for prefetching memory that will soon be read
+#define mu_prefetch(x) __builtin_prefetch(x, 0)
+
+// Builtin for the next power of two, up to 1 << 31
 mu_inline uint32_t mu_npw2(uint32_t i) {
-    return i ? 1 << (32-__builtin_clz(i - 1)) : 0;
+    return i > 1 ? (uint32_t)1 << (32-__builtin_clz(i - 1)) : i;
 }
 
 
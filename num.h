@@ -26,7 +26,7 @@ typedef double num_t;
 
 
 // Max length of a string representation of a number
-#define MU_NUMLEN 14
+#define MU_NUMLEN 25
 
 
 // Returns true if both variables are equal
@@ -36,16 +36,37 @@ bool num_equals(var_t a, var_t b);
 // For integers this is the number
 hash_t num_hash(var_t v);
 
+// Returns the ordering of two numbers, nan orders last
+int num_compare(var_t a, var_t b);
+
 // Parses a string and returns a number
 var_t num_parse(const str_t **off, const str_t *end);
 
+// Writes the shortest string representation of a number that
+// parses back to the same number into a buffer of at least
+// MU_NUMLEN bytes, returning the length
+int num_format(num_t num, mstr_t *buf);
+
 // Obtains a string representation of a number
 var_t num_repr(var_t v, eh_t *eh);
+void num_reprb(var_t v, strb_t *b, eh_t *eh);
+
+
+// Vectorized kernels over arrays of packed nums
+num_t num_sum(const num_t *a, tlen_t len);
+num_t num_min(const num_t *a, tlen_t len);
+num_t num_max(const num_t *a, tlen_t len);
+num_t num_dot(const num_t *a, const num_t *b, tlen_t len);
+void num_scale(num_t *a, num_t s, tlen_t len);
+void num_axpy(num_t s, const num_t *x, num_t *y, tlen_t len);
 
 
 // Checks to see if a number is equivalent to its hash
 mu_inline bool num_ishash(var_t v, hash_t hash) {
-    return isnum(v) && num_equals(v, vnum(hash));
+    if (isint(v))
+        return (hash_t)getint(v) == hash && getint(v) >= 0;
+
+    return isnum(v) && getnum(v) == hash;
 }
 
 // Obtains ascii value
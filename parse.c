@@ -3,6 +3,7 @@
 #include "vm.h"
 #include "lex.h"
 #include "var.h"
+#include "str.h"
 #include "tbl.h"
 #include "fn.h"
 
@@ -28,18 +29,23 @@ static void _expect(parse_t *p, tok_t tok, const char *fn) {
 
 
 // Allocation functions for managing bytecode space
+// the bytecode is kept exactly len bytes, which the
+// finished function frees as its bcount
 static void enlarge(parse_t *p, int count) {
     struct fnparse *fn = p->fn;
+    tlen_t len = fn->len;
     fn->ins += count;
 
+    // offsets must fit the signed 32 bit arguments of jumps
     while (fn->ins > fn->len) {
-        if (((int)fn->len << 1) > MU_MAXLEN)
+        if (fn->len > INT32_MAX >> 1)
             err_len(p->eh);
 
         fn->len <<= 1;
     }
         
-    fn->bcode = mu_realloc(fn->bcode, fn->len, fn->len << 1, p->eh);
+    if (fn->len != len)
+        fn->bcode = mu_realloc(fn->bcode, len, fn->len, p->eh);
 }
 
 static void enlargein(parse_t *p, int count, int ins) {
@@ -84,59 +90,156 @@ static int inserta(parse_t *p, op_t op, arg_t arg, int ins) {
 
 
 // Helping functions for code generation
+static void vgrow(parse_t *p, struct vparse *vars) {
+    uint32_t size = vars->size ? 2*vars->size : 8;
+    uint32_t mask = 2*size - 1;
+    uint32_t i, j;
+
+    vars->vars = arena_realloc(&p->arena, vars->vars,
+                               vars->size*sizeof(var_t),
+                               size*sizeof(var_t), p->eh);
+    vars->hash = arena_alloc(&p->arena, 2*size*sizeof(len_t), p->eh);
+    vars->size = size;
+    memset(vars->hash, 0, 2*size*sizeof(len_t));
+
+    for (i = 0; i < vars->len; i++) {
+        for (j = var_hash(vars->vars[i]) & mask; 
+             vars->hash[j]; j = (j+1) & mask)
+            ;
+
+        vars->hash[j] = i+1;
+    }
+}
+
 static arg_t accvar(parse_t *p, var_t v) {
-    var_t index = tbl_lookup(p->fn->vars, v);
+    struct vparse *vars = p->fn->vars;
+
+    if (isstr(v))
+        v = parse_intern(p, v);
+
+    if (vars->len == vars->size) {
+        if (vars->len == MU_MAXLEN)
+            err_len(p->eh);
+
+        vgrow(p, vars);
+    }
+
+    uint32_t mask = 2*vars->size - 1;
+    uint32_t i;
+
+    for (i = var_hash(v) & mask; vars->hash[i]; i = (i+1) & mask) {
+        if (var_equals(v, vars->vars[vars->hash[i]-1]))
+            return vars->hash[i]-1;
+    }
+
+    vars->vars[vars->len] = v;
+    vars->hash[i] = ++vars->len;
+    return vars->len-1;
+}
+
+static void accfn(parse_t *p, fn_t *fn) {
+    struct fparse *fns = p->fn->fns;
 
-    if (!isnil(index))
-        return getraw(index);
+    if (fns->len == fns->size) {
+        if (fns->len == MU_MAXLEN)
+            err_len(p->eh);
+
+        len_t size = fns->size ? 2*fns->size : 4;
+        fns->fns = arena_realloc(&p->arena, fns->fns,
+                                 fns->size*sizeof(fn_t *),
+                                 size*sizeof(fn_t *), p->eh);
+        fns->size = size;
+    }
 
-    arg_t arg = p->fn->vars->len;
-    tbl_assign(p->fn->vars, v, vraw(arg), p->eh);
-    return arg;
+    fns->fns[fns->len++] = fn;
 }
 
-static void patch(parse_t *p, tbl_t *jtbl, int ins) {
-    tbl_for_begin (k, v, jtbl) {
-        inserta(p, OP_JUMP, ins - (getraw(v)+p->jsize), getraw(v));
-    } tbl_for_end;
+static struct jlist *jlist(parse_t *p, struct jlist *list, int ins) {
+    struct jlist *j = arena_alloc(&p->arena, sizeof(struct jlist), p->eh);
+    j->next = list ? list->next : 0;
+    j->ins = ins;
+
+    if (list)
+        list->next = j;
 
-    tbl_dec(jtbl);
+    return j;
 }
 
-static tbl_t *revargs(tbl_t *args, eh_t *eh) {
-    tbl_t *res = tbl_create(0, eh);
-    int i;
+static void patch(parse_t *p, struct jlist *list, int ins) {
+    for (list = list->next; list; list = list->next)
+        inserta(p, OP_JUMP, ins - (list->ins+p->jsize), list->ins);
+}
+
+static struct aparse *aparse(parse_t *p, struct aparse *args, 
+                             var_t name, struct aparse *nested) {
+    struct aparse *a = arena_alloc(&p->arena, sizeof(struct aparse), p->eh);
+    a->next = args;
+    a->nested = nested;
+    a->name = name;
+    return a;
+}
+
+// Arguments are reversed in place
+static struct aparse *revargs(struct aparse *args) {
+    struct aparse *res = 0;
 
-    for (i = args->len-1; i >= 0; i--) {
-        tbl_append(res, tbl_lookup(args, vnum(i)), eh);
+    while (args) {
+        struct aparse *next = args->next;
+        args->next = res;
+        res = args;
+        args = next;
     }
 
-    tbl_dec(args);
     return res;
 }
 
-static void unpack(parse_t *p, tbl_t *map) {
+static void unpack(parse_t *p, struct aparse *args) {
+    int i;
+
     encode(p, OP_SCOPE);
 
-    tbl_for_begin (k, v, map) {
-        if (istbl(v)) {
+    for (i = 0; args; i++, args = args->next) {
+        if (isnil(args->name)) {
             encodea(p, OP_DUP, 1);
             encode(p, OP_NIL);
-            encodea(p, OP_LOOKDN, getnum(k));
-            unpack(p, gettbl(v));
+            encodea(p, OP_LOOKDN, i);
+            unpack(p, args->nested);
         } else {
-            encodea(p, OP_VAR, accvar(p, v));
+            encodea(p, OP_VAR, accvar(p, args->name));
             encodea(p, OP_DUP, 2);
             encodea(p, OP_DUP, 1);
-            encodea(p, OP_LOOKDN, getnum(k));
+            encodea(p, OP_LOOKDN, i);
             encode(p, OP_INSERT);
         }
-    } tbl_for_end;
+    }
 
     encode(p, OP_DROP);
     encode(p, OP_DROP);
 }
 
+static void unpacknext(parse_t *p, struct aparse *args) {
+    int i;
+
+    // value, key, and index are left on the stack by OP_NEXT
+    for (i = 0; args; i++, args = args->next) {
+        if (isnil(args->name)) {
+            if (i < 3) encodea(p, OP_DUP, 2-i);
+            else       encode(p, OP_NIL);
+            unpack(p, args->nested);
+        } else {
+            encode(p, OP_SCOPE);
+            encodea(p, OP_VAR, accvar(p, args->name));
+            if (i < 3) encodea(p, OP_DUP, 4-i);
+            else       encode(p, OP_NIL);
+            encode(p, OP_INSERT);
+            encode(p, OP_DROP);
+        }
+    }
+
+    encode(p, OP_DROP);
+    encode(p, OP_DROP);
+    encode(p, OP_DROP);
+}
 
 
 // Rules for Mu's grammar
@@ -204,15 +307,17 @@ static void p_fn(parse_t *p) {
     p_args(p);
     expect(p, ')');
 
-    tbl_t *args = p->args;
+    struct aparse *args = p->args;
     struct fnparse *f = p->fn;
     struct jparse j = p->j;
+    uint8_t stmt = p->stmt;
 
     fn_t *fn = fn_create_nested(args, p, p->eh);
-    tbl_append(f->fns, vraw((uint32_t)fn), p->eh);
 
     p->j = j;
     p->fn = f;
+    p->stmt = stmt;
+    accfn(p, fn);
 
     encodea(p, OP_FN, f->fns->len-1);
 }
@@ -235,19 +340,23 @@ static void p_if(parse_t *p) {
         inserta(p, OP_JFALSE, (e_ins+p->jsize) - (i_ins+p->jfsize), i_ins);
         inserta(p, OP_JUMP, p->fn->ins - (e_ins+p->jsize), e_ins);
     } else {
+        int n_ins = p->fn->ins;
+
+        // expressions without else are nil when false
         if (!p->stmt) {
             encodea(p, OP_JUMP, size(OP_NIL));
+            n_ins = p->fn->ins;
             encode(p, OP_NIL);
         }
-        inserta(p, OP_JFALSE, p->fn->ins - (i_ins+p->jfsize), i_ins);
+        inserta(p, OP_JFALSE, n_ins - (i_ins+p->jfsize), i_ins);
     }
 }
 
 static void p_while(parse_t *p) {
     if (!p->stmt) encode(p, OP_TBL);
     struct jparse j = p->j;
-    p->j.ctbl = tbl_create(0, p->eh);
-    p->j.btbl = tbl_create(0, p->eh);
+    p->j.clist = jlist(p, 0, 0);
+    p->j.blist = jlist(p, 0, 0);
     int w_ins = p->fn->ins;
 
     lex(p);
@@ -264,28 +373,29 @@ static void p_while(parse_t *p) {
     inserta(p, OP_JFALSE, (p->fn->ins+p->jsize) - (j_ins+p->jfsize), j_ins);
     encodea(p, OP_JUMP, w_ins - (p->fn->ins+p->jsize));
 
-    patch(p, p->j.ctbl, w_ins);
-    tbl_t *btbl = p->j.btbl;
+    patch(p, p->j.clist, w_ins);
+    struct jlist *blist = p->j.blist;
     p->j = j;
 
     if (p->stmt && p->tok == T_ELSE)
         p_stmt(p);
 
-    patch(p, btbl, p->fn->ins);
+    patch(p, blist, p->fn->ins);
 }
 
 static void p_for(parse_t *p) {
     if (!p->stmt) encode(p, OP_TBL);
 
     struct jparse j = p->j;
-    p->j.ctbl = tbl_create(0, p->eh);
-    p->j.btbl = tbl_create(0, p->eh);
+    p->j.clist = jlist(p, 0, 0);
+    p->j.blist = jlist(p, 0, 0);
     p->left = true;
 
     lex(p);
     expect(p, '(');
     p_args(p);
-    tbl_t *args = revargs(p->args, p->eh);
+    // arguments are bound in reverse to the stack order
+    struct aparse *args = revargs(p->args);
     expect(p, T_SET);
     p_value(p);
     encode(p, OP_ITER);
@@ -294,34 +404,30 @@ static void p_for(parse_t *p) {
     int f_ins = p->fn->ins;
     enlarge(p, p->jsize);
 
-    unpack(p, args);
+    unpacknext(p, args);
     if (p->stmt) {
         p_phrase(p);
     } else {
-        encodea(p, OP_DUP, 1);
+        encodea(p, OP_DUP, 3);
         p_phrase(p);
         encode(p, OP_APPEND);
         encode(p, OP_DROP);
     }
 
     inserta(p, OP_JUMP, p->fn->ins - (f_ins+p->jsize), f_ins);
-    patch(p, p->j.ctbl, p->fn->ins);
+    patch(p, p->j.clist, p->fn->ins);
 
-    encodea(p, OP_DUP, 0);
-    encode(p, OP_TBL);
-    encode(p, OP_CALL);
-    encodea(p, OP_DUP, 0);
+    encodea(p, OP_NEXT, (f_ins+p->jsize) - (p->fn->ins+sizea(OP_NEXT, 0)));
 
-    encodea(p, OP_JTRUE, (f_ins+p->jsize) - (p->fn->ins+p->jtsize));
-    encode(p, OP_DROP);
-
-    tbl_t *btbl = p->j.btbl;
+    struct jlist *blist = p->j.blist;
     p->j = j;
 
     if (p->stmt && p->tok == T_ELSE)
         p_stmt(p);
 
-    patch(p, btbl, p->fn->ins);
+    patch(p, blist, p->fn->ins);
+    encode(p, OP_DROP);
+    encode(p, OP_DROP);
     encode(p, OP_DROP);
 }
 
@@ -510,14 +616,13 @@ static void p_args_entry(parse_t *p) {
         case T_FOR:
         case T_IDENT:  
         case T_NIL:
-        case T_LIT:     tbl_append(p->args, p->val, p->eh);
+        case T_LIT:     p->args = aparse(p, p->args, p->val, 0);
                         lex(p);
                         return p_args_follow(p);
 
-        case '[':       {   tbl_t *args = p->args;
+        case '[':       {   struct aparse *args = p->args;
                             p_args(p);
-                            tbl_append(args, vtbl(p->args), p->eh);
-                            p->args = args;
+                            p->args = aparse(p, args, vnil, p->args);
                         }
                         expect(p, ']');
                         lex(p);
@@ -527,10 +632,11 @@ static void p_args_entry(parse_t *p) {
     }
 }
 
+// Arguments are collected in reverse and put in order once complete
 static void p_args(parse_t *p) {
-    p->args = tbl_create(0, p->eh);
-
-    return p_args_entry(p);
+    p->args = 0;
+    p_args_entry(p);
+    p->args = revargs(p->args);
 }
 
 
@@ -596,14 +702,18 @@ static void p_table_entry(parse_t *p) {
     }
 }
 
+// Entries are always expressions, even in statements
 static void p_table(parse_t *p) {
     uint8_t paren = p->paren;
+    uint8_t stmt = p->stmt;
     p->paren = false;
+    p->stmt = false;
 
     p->left = true;
     p_table_entry(p);
 
     p->paren = paren;
+    p->stmt = stmt;
 }
 
 
@@ -685,14 +795,14 @@ static void p_stmt(parse_t *p) {
                         encode(p, OP_RET);
                         return;
 
-        case T_CONT:    if (!p->j.ctbl) unexpected(p);
-                        tbl_append(p->j.ctbl, vraw(p->fn->ins), p->eh);
+        case T_CONT:    if (!p->j.clist) unexpected(p);
+                        jlist(p, p->j.clist, p->fn->ins);
                         enlarge(p, p->jsize);
                         lex(p);
                         return;
 
-        case T_BREAK:   if (!p->j.btbl) unexpected(p);
-                        tbl_append(p->j.btbl, vraw(p->fn->ins), p->eh);
+        case T_BREAK:   if (!p->j.blist) unexpected(p);
+                        jlist(p, p->j.blist, p->fn->ins);
                         enlarge(p, p->jsize);
                         lex(p);
                         return;
@@ -741,16 +851,21 @@ static void p_stmt_entry(parse_t *p) {
 
 
 // Parses Mu source into bytecode
+// The parse lives in its own arena along with its scratch state
 parse_t *parse_create(var_t code, eh_t *eh) {
-    parse_t *p = mu_alloc(sizeof(parse_t), eh);
+    arena_t arena = {0};
+    parse_t *p = arena_alloc(&arena, sizeof(parse_t), eh);
+    p->arena = arena;
 
-    p->ref = getref(code);
-    p->str = getstart(code);
-    p->pos = getstr(code);
-    p->end = getend(code);
+    // source is read in place so can't be inline
+    mu_assert(!isistr(code));
+
+    p->pos = getstr(&code);
+    p->end = getend(&code);
 
     p->key = false;
     p->paren = false;
+    p->strs = 0;
     p->keys = mu_keys();
 
     p->jsize = sizea(OP_JUMP, 0);
@@ -763,11 +878,42 @@ parse_t *parse_create(var_t code, eh_t *eh) {
 }
 
 void parse_destroy(parse_t *p) {
-    mu_dealloc(p, sizeof(parse_t));
+    struct sparse *s;
+
+    for (s = p->strs; s; s = s->next)
+        var_dec(s->str);
+
+    arena_t arena = p->arena;
+    arena_destroy(&arena);
+}
+
+var_t parse_intern(parse_t *p, var_t v) {
+    struct sparse *s = arena_alloc(&p->arena, sizeof(struct sparse), p->eh);
+
+    s->str = str_intern(v, p->eh);
+    s->next = p->strs;
+    p->strs = s;
+
+    return s->str;
+}
+
+struct aparse *parse_tblargs(parse_t *p, tbl_t *args) {
+    struct aparse *res = 0;
+
+    if (args) {
+        tbl_for_begin (k, v, args) {
+            if (istbl(v))
+                res = aparse(p, res, vnil, parse_tblargs(p, gettbl(v)));
+            else
+                res = aparse(p, res, v, 0);
+        } tbl_for_end;
+    }
+
+    return revargs(res);
 }
 
-void parse_args(parse_t *p, tbl_t *args) {
-    if (args && tbl_len(args) > 0) {
+void parse_args(parse_t *p, struct aparse *args) {
+    if (args) {
         encode(p, OP_ARGS);
         unpack(p, args);
     }
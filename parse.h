@@ -14,26 +14,68 @@
 
 
 // Specific state structures
+// Scratch state is allocated from the parse's arena and
+// released all at once when the parse is destroyed
 struct opparse {
-    len_t ins;
+    tlen_t ins;
     uint8_t lprec;
     uint8_t rprec;
 };
 
+// Jumps waiting on the end of a loop, each list starts
+// with an empty head so loops without jumps are non-null
+struct jlist {
+    struct jlist *next;
+    tlen_t ins;
+};
+
 struct jparse {
-    tbl_t *ctbl;
-    tbl_t *btbl;
+    struct jlist *clist;
+    struct jlist *blist;
+};
+
+// Argument names in order, arguments without names are
+// nested and unpacked from the table at their position
+struct aparse {
+    struct aparse *next;
+    struct aparse *nested;
+    var_t name;
+};
+
+// Constants of a function by index, with a hash of
+// indices plus one so each constant is stored once
+struct vparse {
+    len_t len;
+    uint32_t size;
+
+    var_t *vars;
+    len_t *hash;
+};
+
+// Interned strings the lexer handed out, each holding a
+// reference released when the parse is destroyed
+struct sparse {
+    struct sparse *next;
+    var_t str;
+};
+
+// Nested functions by index
+struct fparse {
+    len_t len;
+    len_t size;
+
+    struct fn **fns;
 };
 
 struct fnparse {
     mstr_t *bcode;
 
+    tlen_t len;
+    tlen_t ins;
     len_t stack;
-    len_t len;
-    len_t ins;
 
-    tbl_t *fns;
-    tbl_t *vars;
+    struct fparse *fns;
+    struct vparse *vars;
 };
 
 // State of a parse
@@ -41,7 +83,8 @@ typedef struct parse {
     struct fnparse *fn;
     struct jparse j;
     struct opparse op;
-    tbl_t *args;
+    struct aparse *args;
+    struct sparse *strs;
 
     tbl_t *keys;
 
@@ -58,12 +101,11 @@ typedef struct parse {
     tok_t tok;
     var_t val;
 
-    ref_t *ref;
-    str_t *str;
     str_t *pos;
     str_t *end;
 
     eh_t *eh;
+    arena_t arena;
 } parse_t;
 
 
@@ -79,7 +121,11 @@ typedef struct parse {
 parse_t *parse_create(var_t code, eh_t *eh);
 void parse_destroy(parse_t *p);
 
-void parse_args(parse_t *p, tbl_t *args);
+// Interns a string, keeping it alive until the parse is destroyed
+var_t parse_intern(parse_t *p, var_t v);
+
+struct aparse *parse_tblargs(parse_t *p, tbl_t *args);
+void parse_args(parse_t *p, struct aparse *args);
 void parse_stmts(parse_t *p);
 void parse_stmt(parse_t *p);
 void parse_expr(parse_t *p);
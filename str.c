@@ -1,51 +1,433 @@
 #include "str.h"
 
 #include "num.h"
+#include "tbl.h"
 #include "mem.h"
 #include "err.h"
 
 #include <string.h>
 
 
+// Strings keep their length in the header before the reference
+// count, strings past MU_BIGSTR are prefixed with another header
+// holding their length, padded to keep the string aligned
+#define MU_STRHEAD 8
+
+// Accessing string allocations
+mu_inline len_t *str_head(str_t *start) {
+    return (len_t *)((ref_t *)start - 1) - 1;
+}
+
+mu_inline slen_t str_size(str_t *start) {
+    const len_t *len = str_head(start);
+
+    if (mu_unlikely(*len == MU_BIGSTR))
+        return ((const slen_t *)((const ref_t *)start - 1))[-2];
+
+    return *len;
+}
+
+mu_inline strt_t *str_trailer(str_t *start) {
+    return (strt_t *)(~3 & (3 + (uintptr_t)(start + str_size(start))));
+}
+
+mu_inline bool str_isinterned(var_t v) {
+    return !isistr(v) && str_trailer(getstr(&v))->interned;
+}
+
+// Size of allocation including the trailer and its alignment
+mu_inline size_t str_alloc(slen_t size) {
+    return size + 3 + sizeof(strt_t);
+}
+
+mu_inline size_t str_bigalloc(slen_t size) {
+    return MU_STRHEAD + MU_REFHEAD + str_alloc(size);
+}
+
 // Functions for creating strings
-mstr_t *str_create(len_t size, eh_t *eh) {
-    len_t *len = ref_alloc(size + sizeof(len_t), eh);
-    *len = size;
+mstr_t *str_create(slen_t size, eh_t *eh) {
+    mstr_t *str;
+
+    if (mu_likely(size < MU_BIGSTR)) {
+        str = ref_alloc(str_alloc(size), eh);
+        *str_head(str) = size;
+    } else {
+        if (size > MU_MAXSLEN)
+            err_len(eh);
+
+        uint8_t *m = mu_alloc(str_bigalloc(size), eh);
+        str = m + MU_STRHEAD + MU_REFHEAD;
+
+        ref_t *ref = (ref_t *)str - 1;
+        *ref = 1;
+        ((slen_t *)ref)[-2] = size;
+        *str_head(str) = MU_BIGSTR;
+    }
+
+    *str_trailer(str) = (strt_t){0};
+
+    return str;
+}
+
+// Resizes the allocation of a string, keeping its contents
+static mstr_t *str_resize(mstr_t *str, slen_t size, eh_t *eh) {
+    slen_t prev = str_size(str);
+
+    // strings crossing MU_BIGSTR change headers and are copied
+    if (prev >= MU_BIGSTR || size >= MU_BIGSTR) {
+        mstr_t *res = str_create(size, eh);
+        memcpy(res, str, prev < size ? prev : size);
+        str_destroy(str);
+        return res;
+    }
+
+    uint8_t *m = mu_realloc(str - MU_REFHEAD, 
+                            MU_REFHEAD + str_alloc(prev),
+                            MU_REFHEAD + str_alloc(size), eh);
+
+    str = m + MU_REFHEAD;
+    *str_head(str) = size;
+    *str_trailer(str) = (strt_t){0};
+
+    return str;
+}
+
+// Functions for building strings
+void strb_init(strb_t *b, slen_t size, eh_t *eh) {
+    b->str = str_create(size, eh);
+    b->len = 0;
+}
+
+mstr_t *strb_reserve(strb_t *b, slen_t size, eh_t *eh) {
+    slen_t cap = str_size(b->str);
+
+    if (size > MU_MAXSLEN - b->len)
+        err_len(eh);
+
+    if (b->len + size > cap) {
+        cap = 2*cap > b->len + size ? 2*cap : b->len + size;
+        b->str = str_resize(b->str, cap < MU_MAXSLEN ? cap : MU_MAXSLEN, eh);
+    }
+
+    return b->str + b->len;
+}
+
+void strb_append(strb_t *b, var_t s, eh_t *eh) {
+    slen_t len = getlen(s);
+
+    memcpy(strb_reserve(b, len, eh), getstr(&s), len);
+    b->len += len;
+}
+
+var_t strb_finish(strb_t *b, eh_t *eh) {
+    if (b->len != str_size(b->str))
+        b->str = str_resize(b->str, b->len, eh);
+
+    return vstr(b->str);
+}
+
+// Interned strings are held weakly in an open addressed set,
+// each string removes itself from the set when it is destroyed
+static struct {
+    var_t *strs;
+    uint32_t len;
+    uint32_t cap;
+} str_interns;
+
+// Finds the slot holding a string equal to v, or the empty slot
+// where it belongs, the set is kept at most half full
+static var_t *str_ifind(var_t v, hash_t hash) {
+    uint32_t mask = str_interns.cap - 1;
+    uint32_t i;
+
+    for (i = hash & mask;; i = (i+1) & mask) {
+        var_t *s = &str_interns.strs[i];
+
+        if (isnil(*s) || (getlen(*s) == getlen(v) &&
+                          !memcmp(getstr(s), getstr(&v), getlen(v))))
+            return s;
+    }
+}
+
+static void str_igrow(eh_t *eh) {
+    var_t *strs = str_interns.strs;
+    uint32_t cap = str_interns.cap;
+    uint32_t i;
+
+    str_interns.cap = cap ? 2*cap : 16;
+    str_interns.strs = mu_alloc(str_interns.cap*sizeof(var_t), eh);
+    memset(str_interns.strs, 0, str_interns.cap*sizeof(var_t));
+
+    for (i = 0; i < cap; i++) {
+        if (!isnil(strs[i]))
+            *str_ifind(strs[i], str_hash(strs[i])) = strs[i];
+    }
+
+    mu_dealloc(strs, cap*sizeof(var_t));
+}
+
+// Removes a dying string from the set, later entries in its
+// probe sequence are shifted back so lookups never see a gap
+static void str_iremove(var_t v) {
+    uint32_t mask = str_interns.cap - 1;
+    uint32_t i = str_hash(v) & mask;
+    uint32_t j;
+
+    while (str_interns.strs[i].bits != v.bits)
+        i = (i+1) & mask;
+
+    for (j = (i+1) & mask; !isnil(str_interns.strs[j]); j = (j+1) & mask) {
+        uint32_t k = str_hash(str_interns.strs[j]) & mask;
+
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+
+        str_interns.strs[i] = str_interns.strs[j];
+        i = j;
+    }
+
+    str_interns.strs[i] = vnil;
+    str_interns.len--;
+
+    if (str_interns.len == 0) {
+        mu_dealloc(str_interns.strs, str_interns.cap*sizeof(var_t));
+        str_interns.strs = 0;
+        str_interns.cap = 0;
+    }
+}
+
+// Returns the canonical copy of a string
+// short strings are canonical when inline
+var_t str_intern(var_t v, eh_t *eh) {
+    if (getlen(v) <= MU_STRINLINE)
+        return vistr(getstr(&v), getlen(v));
+
+    if (str_isinterned(v)) {
+        var_inc(v);
+        return v;
+    }
+
+    if (2*(str_interns.len+1) > str_interns.cap)
+        str_igrow(eh);
+
+    var_t *slot = str_ifind(v, str_hash(v));
+
+    if (!isnil(*slot)) {
+        var_inc(*slot);
+        return *slot;
+    }
 
-    return (mstr_t *)(len + 1);
+    mstr_t *str = str_create(getlen(v), eh);
+    memcpy(str, getstr(&v), getlen(v));
+    var_t s = vstr(str);
+
+    // the hash is cached so the string can find itself
+    // in the set when it is destroyed
+    str_hash(s);
+    str_trailer(str)->interned = true;
+
+    *slot = s;
+    str_interns.len++;
+    return s;
 }
 
 // Called by garbage collector to clean up
 void str_destroy(void *m) {
-    ref_dealloc(m, *(len_t *)m + sizeof(len_t));
+    slen_t size = str_size(m);
+
+    if (str_trailer(m)->interned)
+        str_iremove(vstr(m));
+
+    if (mu_unlikely(size >= MU_BIGSTR))
+        mu_dealloc((uint8_t *)m - MU_REFHEAD - MU_STRHEAD,
+                   str_bigalloc(size));
+    else
+        ref_dealloc(m, str_alloc(size));
 }
 
 // Returns true if both variables are equal
+// interned strings are only equal to themselves
 bool str_equals(var_t a, var_t b) {
-    return getlen(a) == getlen(b) && 
-           !memcmp(getstr(a), getstr(b), getlen(a));
+    if (a.bits == b.bits)
+        return true;
+
+    if (getlen(a) != getlen(b))
+        return false;
+
+    if ((isistr(a) && isistr(b)) ||
+        (str_isinterned(a) && str_isinterned(b)))
+        return false;
+
+    return !memcmp(getstr(&a), getstr(&b), getlen(a));
 }
 
+// Seed for string hashes, randomized at startup so
+// hash collisions can't be predicted from the input
+static uint32_t str_seedv = 0x2d358dcc;
+
+void str_seed(uint32_t seed) {
+    str_seedv = seed;
+}
+
+// Mixes two words through a 64 bit product as in wyhash32
+mu_inline void str_mix(uint32_t *a, uint32_t *b) {
+    uint64_t c = (uint64_t)(*a ^ 0x53c5ca59) * (*b ^ 0x74743c1b);
+    *a = c;
+    *b = c >> 32;
+}
+
+mu_inline uint32_t str_read(str_t *p) {
+    uint32_t w;
+    memcpy(&w, p, sizeof w);
+    return w;
+}
+
+// Lanes of words mixed in parallel for long strings
+typedef uint64_t strv_t __attribute__((vector_size(16)));
+
 // Returns a hash for each string
-// based off the djb2 algorithm
+// based off the wyhash32 algorithm
+// The hash is cached in the trailer of strings outside vars
 hash_t str_hash(var_t v) {
-    str_t *str = getstr(v);
-    str_t *end = getend(v);
-    hash_t hash = 5381;
+    strt_t *t = !isistr(v) ? str_trailer(getstr(&v)) : 0;
+
+    if (t && t->hashed)
+        return t->hash;
+
+    str_t *str = getstr(&v);
+    slen_t len = getlen(v);
+    uint32_t a = str_seedv;
+    uint32_t b = len;
+    str_mix(&a, &b);
+
+    // long strings are mixed 16 bytes at a time in two
+    // independent lanes which can share vector registers
+    if (len > 32) {
+        strv_t va = {a, a ^ 0x9e3779b9};
+        strv_t vb = {b, b ^ 0x85ebca6b};
+
+        for (; len > 16; len -= 16, str += 16) {
+            va ^= (strv_t){str_read(str+0), str_read(str+8)};
+            vb ^= (strv_t){str_read(str+4), str_read(str+12)};
+
+            strv_t c = (va ^ 0x53c5ca59) * (vb ^ 0x74743c1b);
+            va = c & 0xffffffff;
+            vb = c >> 32;
+        }
+
+        a = va[0];
+        b = vb[0];
+        str_mix(&a, &b);
+        a ^= va[1];
+        b ^= vb[1];
+    }
+
+    for (; len > 8; len -= 8, str += 8) {
+        a ^= str_read(str+0);
+        b ^= str_read(str+4);
+        str_mix(&a, &b);
+    }
 
-    while (str < end) {
-        // hash = 33*hash + *str++
-        hash = (hash << 5) + hash + *str++;
+    if (len >= 4) {
+        a ^= str_read(str);
+        b ^= str_read(str+len-4);
+    } else if (len > 0) {
+        a ^= (str[0] << 16) | (str[len>>1] << 8) | str[len-1];
+    }
+
+    str_mix(&a, &b);
+    str_mix(&a, &b);
+    hash_t hash = a ^ b;
+
+    // literals in readonly memory have no reference count
+    // and can't store their hash
+    if (t && *getref(v) != 0) {
+        t->hash = hash;
+        t->hashed = true;
     }
 
     return hash;
 }
 
+// Returns the ordering of two strings, comparing
+// bytes and then lengths for shared prefixes
+int str_compare(var_t a, var_t b) {
+    slen_t len = getlen(a) < getlen(b) ? getlen(a) : getlen(b);
+    int cmp = memcmp(getstr(&a), getstr(&b), len);
+
+    if (cmp)
+        return cmp;
+
+    return (getlen(a) > getlen(b)) - (getlen(a) < getlen(b));
+}
+
+// Vectorized scanning for bytes that need escaping
+// These use gcc's generic vectors as the num kernels do, so
+// clean runs of bytes are skipped a vector at a time and
+// copied in bulk between escapes.
+#define MU_STRVEC 16
+
+typedef uint8_t strc_t __attribute__((vector_size(MU_STRVEC)));
+
+mu_inline strc_t strc_load(str_t *s) {
+    strc_t v;
+    memcpy(&v, s, sizeof v);
+    return v;
+}
+
+// Returns the first lane set in a comparison, or MU_STRVEC
+mu_inline int strc_first(strc_t m) {
+    uint64_t w[2];
+    memcpy(w, &m, sizeof w);
+
+    if (w[0])
+        return __builtin_ctzll(w[0]) / 8;
+    else if (w[1])
+        return 8 + __builtin_ctzll(w[1]) / 8;
+    else
+        return MU_STRVEC;
+}
+
+// Returns the next quote or backslash in a string literal
+static str_t *str_scanparse(str_t *pos, str_t *end, str_t quote) {
+    for (; end-pos >= MU_STRVEC; pos += MU_STRVEC) {
+        strc_t v = strc_load(pos);
+        int i = strc_first((strc_t)((v == quote) | (v == '\\')));
+
+        if (i < MU_STRVEC)
+            return pos + i;
+    }
+
+    while (pos < end && *pos != quote && *pos != '\\')
+        pos++;
+
+    return pos;
+}
+
+// Returns the next byte that must be escaped in a repr
+static str_t *str_scanrepr(str_t *pos, str_t *end) {
+    for (; end-pos >= MU_STRVEC; pos += MU_STRVEC) {
+        strc_t v = strc_load(pos);
+        int i = strc_first((strc_t)((v < ' ') | (v > '~') |
+                                    (v == '\\') | (v == '\'')));
+
+        if (i < MU_STRVEC)
+            return pos + i;
+    }
+
+    while (pos < end && !(*pos < ' ' || *pos > '~' ||
+                          *pos == '\\' || *pos == '\''))
+        pos++;
+
+    return pos;
+}
+
+
 // Parses a string and returns a string
 var_t str_parse(const str_t **off, const str_t *end, eh_t *eh) {
     str_t *pos = *off + 1;
     str_t quote = **off;
-    int size = 0;
+    size_t size = 0;
 
     while (*pos != quote) {
         if (pos == end)
@@ -99,15 +481,18 @@ var_t str_parse(const str_t **off, const str_t *end, eh_t *eh) {
                     break;
             }
         } else {
-            size++;
-            pos++;
+            str_t *run = str_scanparse(pos+1, end, quote);
+            size += run - pos;
+            pos = run;
         }
     }
 
-    if (size > MU_MAXLEN)
+    if (size > MU_MAXSLEN)
         err_len(eh);
 
-    mstr_t *out = str_create(size, eh);
+    // short strings are written inline
+    mstr_t istr[MU_STRINLINE];
+    mstr_t *out = size <= MU_STRINLINE ? istr : str_create(size, eh);
     mstr_t *res = out;
     pos = *off + 1;
 
@@ -115,23 +500,23 @@ var_t str_parse(const str_t **off, const str_t *end, eh_t *eh) {
         if (*pos == '\\') {
             switch (pos[1]) {
                 case 'o':
-                    *res++ = num_val(pos[2])*7*7 +
-                             num_val(pos[3])*7 +
+                    *res++ = num_val(pos[2])*8*8 +
+                             num_val(pos[3])*8 +
                              num_val(pos[4]);
-                    pos += 4;
+                    pos += 5;
                     break;
 
                 case 'd':
                     *res++ = num_val(pos[2])*10*10 +
                              num_val(pos[3])*10 +
                              num_val(pos[4]);
-                    pos += 4;
+                    pos += 5;
                     break;
 
                 case 'x':
                     *res++ = num_val(pos[2])*16 +
                              num_val(pos[3]);
-                    pos += 3;
+                    pos += 4;
                     break;
 
                 case '\n': pos += 2; break;
@@ -149,26 +534,35 @@ var_t str_parse(const str_t **off, const str_t *end, eh_t *eh) {
                 default:   *res++ = '\\'; pos += 1; break;
             }
         } else {
-            *res++ = *pos++;
+            str_t *run = str_scanparse(pos+1, end, quote);
+            memcpy(res, pos, run - pos);
+            res += run - pos;
+            pos = run;
         }
     }
 
 
     *off = pos + 1;
 
-    return vstr(out, 0, size);
+    if (size <= MU_STRINLINE)
+        return vistr(istr, size);
+
+    return vstr(out);
 }
 
 
 // Returns a string representation of a string
 var_t str_repr(var_t v, eh_t *eh) {
-    str_t *pos = getstr(v);    
-    str_t *end = getend(v);
-    int size = 2;
+    str_t *pos = getstr(&v);
+    str_t *end = getend(&v);
+    size_t size = 2;
 
     while (pos < end) {
-        if (*pos < ' ' || *pos > '~' || 
-            *pos == '\\' || *pos == '\'') {
+        str_t *run = str_scanrepr(pos, end);
+        size += run - pos;
+        pos = run;
+
+        if (pos < end) {
             switch (*pos) {
                 case '\'':
                 case '\\':
@@ -182,24 +576,29 @@ var_t str_repr(var_t v, eh_t *eh) {
                 case '\0': size += 1; break;
                 default: size += 3; break;
             }
-        }
 
-        size++;
-        pos++;
+            size++;
+            pos++;
+        }
     }
 
-    if (size > MU_MAXLEN)
+    if (size > MU_MAXSLEN)
         err_len(eh);
 
-    mstr_t *out = str_create(size, eh);
+    mstr_t istr[MU_STRINLINE];
+    mstr_t *out = size <= MU_STRINLINE ? istr : str_create(size, eh);
     mstr_t *res = out;
-    pos = getstr(v);
+    pos = getstr(&v);
 
     *res++ = '\'';
 
     while (pos < end) {
-        if (*pos < ' ' || *pos > '~' || 
-            *pos == '\\' || *pos == '\'') {
+        str_t *run = str_scanrepr(pos, end);
+        memcpy(res, pos, run - pos);
+        res += run - pos;
+        pos = run;
+
+        if (pos < end) {
             *res++ = '\\';
 
             switch (*pos) {
@@ -219,16 +618,17 @@ var_t str_repr(var_t v, eh_t *eh) {
                     *res++ = num_ascii(*pos % 16);
                     break;
             }
-        } else {
-            *res++ = *pos;
-        }
 
-        pos++;
+            pos++;
+        }
     }
 
     *res++ = '\'';
 
-    return vstr(out, 0, size);
+    if (size <= MU_STRINLINE)
+        return vistr(istr, size);
+
+    return vstr(out);
 }
 
 
@@ -14,6 +14,18 @@
 typedef uint8_t mstr_t;
 typedef const mstr_t str_t;
 
+// Trailer stored after the bytes of each string, the bytes
+// must start directly after the reference count and its header
+// so the trailer holds any additional metadata
+typedef struct strt {
+    uint32_t hash;      // cached hash of the whole string
+    bool hashed;        // hash has been computed
+    bool interned;      // string is the canonical copy
+} strt_t;
+
+// Builder for strings, defined below
+typedef struct strb strb_t;
+
 
 #endif
 #else
@@ -25,9 +37,30 @@ typedef const mstr_t str_t;
 #include "err.h"
 #undef MU_DEF
 
+// Builder for strings, appending into a buffer
+// which grows by doubling until finished
+struct strb {
+    mstr_t *str;        // buffer being written
+    slen_t len;         // bytes written so far
+};
+
 
 // Functions for creating strings
-mstr_t *str_create(len_t size, eh_t *eh);
+mstr_t *str_create(slen_t size, eh_t *eh);
+
+// Functions for building strings in amortized linear time
+void strb_init(strb_t *, slen_t size, eh_t *eh);
+void strb_append(strb_t *, var_t s, eh_t *eh);
+
+// Reserves space for size more bytes, which are written to the
+// returned buffer before advancing len by the bytes written
+mstr_t *strb_reserve(strb_t *, slen_t size, eh_t *eh);
+var_t strb_finish(strb_t *, eh_t *eh);
+
+// Returns the canonical copy of a string, interned strings
+// compare equal only to themselves and are counted like any
+// other string, leaving the intern set when they are freed
+var_t str_intern(var_t v, eh_t *eh);
 
 // Called by garbage collector to clean up
 void str_destroy(void *);
@@ -38,6 +71,12 @@ bool str_equals(var_t a, var_t b);
 // Returns a hash for each string
 hash_t str_hash(var_t v);
 
+// Seeds string hashes, must be called before any hashing
+void str_seed(uint32_t seed);
+
+// Returns the ordering of two strings bytewise
+int str_compare(var_t a, var_t b);
+
 // Parses a string and returns a string
 var_t str_parse(const str_t **off, const str_t *end, eh_t *eh);
 
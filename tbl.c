@@ -10,9 +10,118 @@
 
 // TODO check lengths appropriately
 
-// finds capactiy based on load factor of 1.5
+// finds capactiy based on load factor of 1.5, rounded up
+// so a single entry never fills a table and stalls probing
 mu_inline hash_t tbl_ncap(hash_t s) {
-    return s + (s >> 1);
+    return s + ((s + 1) >> 1);
+}
+
+// Size of entries in the array for each stride
+mu_inline size_t tbl_entry(tbl_t *tbl) {
+    return tbl->stride == TBL_NUMS ? sizeof(num_t) : sizeof(var_t);
+}
+
+// Allocates storage for entries, small tables use
+// the slots stored inline with the table itself
+static void *tbl_alloc(tbl_t *tbl, size_t size, eh_t *eh) {
+    if (size <= sizeof tbl->slots)
+        return tbl->slots;
+
+    return mu_alloc(size, eh);
+}
+
+static void tbl_dealloc(tbl_t *tbl, void *m, size_t size) {
+    if (m != tbl->slots)
+        mu_dealloc(m, size);
+}
+
+// Hashed tables small enough for the inline slots are scanned
+// in order rather than probed, so they can fill every pair
+#define MU_TBLSCAN (MU_TBLSLOTS / 2)
+
+mu_inline bool tbl_scanned(tbl_t *tbl) {
+    return tbl->array == tbl->slots;
+}
+
+// Whether a table has room for the given number of entries
+mu_inline bool tbl_room(tbl_t *tbl, hash_t size) {
+    if (tbl->stride == TBL_HASH && tbl_scanned(tbl))
+        return size <= tbl->mask + 1;
+
+    return tbl_ncap(size) <= tbl->mask + 1;
+}
+
+// Sorted tables are stored as a two level tree, an ordered
+// array of leaves each holding a sorted run of entries.
+// Leaves are split when full and removed once empty.
+struct leaf {
+    hash_t len;                     // count of entries
+    var_t array[2*MU_LEAFLEN];      // sorted keys and values
+};
+
+// Persistent tables are stored as a trie of shared nodes
+static void hnode_destroy(void *);
+
+
+// Bloom filter bits for a hash, tables used as tails keep
+// a filter of their keys so lookups falling through the
+// tail chain can skip levels without probing. Two bits of
+// 64 keep false positives under one in six up to the 16
+// keys of MU_TBLBLOOM, larger tables fill the filter and
+// are always probed until shrunk by a rehash.
+#define MU_TBLBLOOM 16
+#define MU_TBLFULL (~(uint64_t)0)
+
+mu_inline uint64_t tbl_bloom(hash_t hash) {
+    return ((uint64_t)1 << (hash & 63)) |
+           ((uint64_t)1 << ((hash >> 6) & 63));
+}
+
+mu_inline bool tbl_maybe(tbl_t *tbl, hash_t hash) {
+    uint64_t bits = tbl_bloom(hash);
+    return !tbl->tailed || (tbl->bloom & bits) == bits;
+}
+
+// Adds a key inserted into a hashed table to its filter,
+// tables which are not tails skip the filter entirely
+mu_inline void tbl_filter(tbl_t *tbl, hash_t hash) {
+    if (tbl->tailed)
+        tbl->bloom |= tbl->len < MU_TBLBLOOM ? tbl_bloom(hash)
+                                             : MU_TBLFULL;
+}
+
+// Rebuilds the filter of a hashed table from its keys,
+// which also drops the bits of removed keys
+static void tbl_refilter(tbl_t *tbl) {
+    if (!tbl->tailed || tbl->stride != TBL_HASH)
+        return;
+
+    if (tbl->len > MU_TBLBLOOM) {
+        tbl->bloom = MU_TBLFULL;
+        return;
+    }
+
+    hash_t i;
+    tbl->bloom = 0;
+
+    for (i=0; i <= tbl->mask; i++) {
+        var_t *v = &tbl->array[2*i];
+
+        if (!isnil(v[0]) && !isnil(v[1]))
+            tbl->bloom |= tbl_bloom(var_hash(v[0]));
+    }
+}
+
+// Mixes a hash before probing, integer keys hash to their
+// own value for implicit indices, which would otherwise
+// cluster in regular patterns under the probe sequence
+mu_inline hash_t tbl_mix(hash_t hash) {
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
 }
 
 // Iterates through hash entries using i = i*5 + 1
@@ -23,11 +132,38 @@ mu_inline hash_t tbl_next(hash_t i) {
     return (i<<2) + i + 1;
 }
 
+// Finds the pair holding a key in a hashed table or the empty
+// pair where it belongs, full scanned tables may have neither
+mu_inline var_t *tbl_find(tbl_t *tbl, var_t key, hash_t hash) {
+    hash_t i;
+
+    if (tbl_scanned(tbl)) {
+        for (i = 0; i <= tbl->mask; i++) {
+            var_t *v = &tbl->array[2*i];
+
+            if (isnil(v[0]) || var_equals(key, v[0]))
+                return v;
+        }
+
+        return 0;
+    }
+
+    for (i = tbl_mix(hash);; i = tbl_next(i)) {
+        var_t *v = &tbl->array[2*(i & tbl->mask)];
+
+        if (isnil(v[0]) || var_equals(key, v[0]))
+            return v;
+    }
+}
+
 
 // Functions for managing tables
 // Each table is preceeded with a reference count
 // which is used as its handle in a var
-tbl_t *tbl_create(len_t size, eh_t *eh) {
+tbl_t *tbl_create(tlen_t size, eh_t *eh) {
+    if (size > MU_MAXTLEN)
+        err_len(eh);
+
     tbl_t *tbl = ref_alloc(sizeof(tbl_t), eh);
 
     tbl->mask = mu_npw2(tbl_ncap(size)) - 1;
@@ -37,20 +173,92 @@ tbl_t *tbl_create(len_t size, eh_t *eh) {
     tbl->len = 0;
 
     tbl->offset = 0;
+    tbl->step = 1;
     tbl->stride = 0;
+    tbl->tailed = false;
 
     return tbl;
 }
 
+// Creates a table containing the implicit range
+// offset, offset+step, ... without storing any entries
+tbl_t *tbl_range(int offset, int step, tlen_t len, eh_t *eh) {
+    tbl_t *tbl = tbl_create(len, eh);
 
-// Called by garbage collector to clean up
-void tbl_destroy(void *m) {
-    tbl_t *tbl = m;
+    tbl->offset = offset;
+    tbl->step = step;
+    tbl->len = len;
 
-    if (tbl->stride > 0) {
+    return tbl;
+}
+
+// Creates a view of entries offset, offset+step, ... in a
+// table, entries are only copied once the slice is written
+// Changes to the base table are visible through the slice
+// Ranges are viewed like any other table, since they are
+// realized in place once written
+tbl_t *tbl_slice(tbl_t *base, int offset, int step, tlen_t len, eh_t *eh) {
+    base = tbl_read(base);
+
+    if (base->stride == TBL_SLICE) {
+        offset = base->offset + offset*base->step;
+        step = step*base->step;
+        base = base->base;
+    }
+
+    tbl_t *tbl = tbl_create(len, eh);
+    tbl_inc(base);
+
+    tbl->stride = TBL_SLICE;
+    tbl->base = base;
+    tbl->offset = offset;
+    tbl->step = step;
+    tbl->len = len;
+
+    return tbl;
+}
+
+
+// Creates a table which keeps its keys in sorted order
+tbl_t *tbl_sorted(eh_t *eh) {
+    tbl_t *tbl = tbl_create(0, eh);
+
+    tbl->stride = TBL_TREE;
+    tbl->mask = 0;
+    tbl->leaves = tbl_alloc(tbl, sizeof(struct leaf *), eh);
+    tbl->count = 0;
+
+    return tbl;
+}
+
+
+// Releases the entries and tail of a table
+static void tbl_empty(tbl_t *tbl) {
+    if (tbl->stride == TBL_SLICE) {
+        tbl_dec(tbl->base);
+    } else if (tbl->stride == TBL_NUMS) {
+        tbl_dealloc(tbl, tbl->nums, (tbl->mask+1) * sizeof(num_t));
+    } else if (tbl->stride == TBL_TREE) {
+        hash_t i, j;
+
+        for (i=0; i < tbl->count; i++) {
+            struct leaf *l = tbl->leaves[i];
+
+            for (j=0; j < 2*l->len; j++)
+                var_dec(l->array[j]);
+
+            mu_dealloc(l, sizeof(struct leaf));
+        }
+
+        tbl_dealloc(tbl, tbl->leaves, 
+                    (tbl->mask+1) * sizeof(struct leaf *));
+    } else if (tbl->stride == TBL_HAMT) {
+        if (tbl->root)
+            ref_dec(tbl->root, hnode_destroy);
+    } else if (tbl->stride != TBL_RANGE) {
         int i, cap, entries;
 
-        if (tbl->stride < 2) {
+        if (tbl->stride == TBL_LIST) {
             cap = tbl->mask + 1;
             entries = tbl->len;
         } else {
@@ -61,47 +269,716 @@ void tbl_destroy(void *m) {
         for (i=0; i < entries; i++)
             var_dec(tbl->array[i]);
 
-        mu_dealloc(tbl->array, cap * sizeof(var_t));
+        tbl_dealloc(tbl, tbl->array, cap * sizeof(var_t));
     }
 
     if (tbl->tail)
         tbl_dec(tbl->tail);
+}
 
+// Called by garbage collector to clean up
+void tbl_destroy(void *m) {
+    tbl_empty(m);
     ref_dealloc(m, sizeof(tbl_t));
 }
 
 
+// Looks up an index in a table with implicit keys
+mu_inline var_t tbl_index(tbl_t *tbl, hash_t i) {
+    switch (tbl->stride) {
+        case TBL_RANGE: return vnum(tbl->offset + (num_t)i*tbl->step);
+        case TBL_SLICE: return tbl_lookup(tbl->base, 
+                                vnum(tbl->offset + (num_t)i*tbl->step));
+        case TBL_NUMS:  return vnum(tbl->nums[i]);
+        default:        return tbl->array[i];
+    }
+}
+
+// Checks if a value continues the range at an index
+mu_inline bool tbl_inrange(tbl_t *tbl, hash_t i, var_t val) {
+    return isnum(val) && 
+           getnum(val) == tbl->offset + (num_t)i*tbl->step;
+}
+
+
+// Finds the first leaf whose last key is not less than key
+static hash_t tree_leaf(tbl_t *tbl, var_t key) {
+    hash_t lo = 0, hi = tbl->count;
+
+    while (lo < hi) {
+        hash_t mid = lo + (hi-lo)/2;
+        struct leaf *l = tbl->leaves[mid];
+
+        if (var_compare(l->array[2*(l->len-1)], key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// Finds the first entry whose key is not less than key
+static hash_t leaf_lower(struct leaf *l, var_t key) {
+    hash_t lo = 0, hi = l->len;
+
+    while (lo < hi) {
+        hash_t mid = lo + (hi-lo)/2;
+
+        if (var_compare(l->array[2*mid], key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// Finds the entry for a key in a sorted table
+static var_t *tree_find(tbl_t *tbl, var_t key) {
+    hash_t i = tree_leaf(tbl, key);
+
+    if (i >= tbl->count)
+        return 0;
+
+    struct leaf *l = tbl->leaves[i];
+    hash_t j = leaf_lower(l, key);
+
+    if (j >= l->len || var_compare(l->array[2*j], key) != 0)
+        return 0;
+
+    return &l->array[2*j];
+}
+
+// Creates an empty leaf at position i
+static struct leaf *tree_addleaf(tbl_t *tbl, hash_t i, eh_t *eh) {
+    if (tbl->count > tbl->mask) {
+        hash_t cap = 2*(tbl->mask+1);
+        struct leaf **w = tbl_alloc(tbl, cap * sizeof(struct leaf *), eh);
+
+        if (w != tbl->leaves) {
+            memcpy(w, tbl->leaves, tbl->count * sizeof(struct leaf *));
+            tbl_dealloc(tbl, tbl->leaves, 
+                        (tbl->mask+1) * sizeof(struct leaf *));
+        }
+
+        tbl->leaves = w;
+        tbl->mask = cap - 1;
+    }
+
+    struct leaf *l = mu_alloc(sizeof(struct leaf), eh);
+    l->len = 0;
+
+    memmove(&tbl->leaves[i+1], &tbl->leaves[i], 
+            (tbl->count-i) * sizeof(struct leaf *));
+    tbl->leaves[i] = l;
+    tbl->count++;
+
+    return l;
+}
+
+// Inserts an entry into a sorted table, replacing the
+// value if the key is already present
+static void tree_insert(tbl_t *tbl, var_t key, var_t val, eh_t *eh) {
+    hash_t i = tree_leaf(tbl, key);
+
+    // keys past the end are appended to the last leaf
+    if (i == tbl->count && i > 0)
+        i--;
+
+    if (tbl->count == 0)
+        tree_addleaf(tbl, 0, eh);
+
+    struct leaf *l = tbl->leaves[i];
+    hash_t j = leaf_lower(l, key);
+
+    if (j < l->len && var_compare(l->array[2*j], key) == 0) {
+        var_dec(l->array[2*j+1]);
+        l->array[2*j+1] = val;
+        var_dec(key);
+        return;
+    }
+
+    if (l->len == MU_LEAFLEN) {
+        // appending starts a new leaf so ordered inserts
+        // leave full leaves behind, otherwise split in half
+        hash_t half = (j == l->len) ? l->len : l->len/2;
+        struct leaf *r = tree_addleaf(tbl, i+1, eh);
+
+        memcpy(r->array, &l->array[2*half], 
+               2*(l->len-half) * sizeof(var_t));
+        r->len = l->len - half;
+        l->len = half;
+
+        if (j >= half) {
+            l = r;
+            j -= half;
+        }
+    }
+
+    memmove(&l->array[2*j+2], &l->array[2*j], 
+            2*(l->len-j) * sizeof(var_t));
+    l->array[2*j  ] = key;
+    l->array[2*j+1] = val;
+    l->len++;
+    tbl->len++;
+}
+
+// Removes the entry for a key from a sorted table
+static void tree_remove(tbl_t *tbl, var_t key) {
+    hash_t i = tree_leaf(tbl, key);
+
+    if (i >= tbl->count)
+        return;
+
+    struct leaf *l = tbl->leaves[i];
+    hash_t j = leaf_lower(l, key);
+
+    if (j >= l->len || var_compare(l->array[2*j], key) != 0)
+        return;
+
+    var_dec(l->array[2*j  ]);
+    var_dec(l->array[2*j+1]);
+
+    memmove(&l->array[2*j], &l->array[2*j+2], 
+            2*(l->len-j-1) * sizeof(var_t));
+    l->len--;
+    tbl->len--;
+
+    if (l->len == 0) {
+        mu_dealloc(l, sizeof(struct leaf));
+        memmove(&tbl->leaves[i], &tbl->leaves[i+1], 
+                (tbl->count-i-1) * sizeof(struct leaf *));
+        tbl->count--;
+    }
+}
+
+
+// Persistent tables are stored as a hash array mapped trie.
+// Each node holds entries and subnodes for 32 slots indexed
+// by 5 bits of the hash. Nodes are reference counted and
+// shared between tables so updates copy only the path to
+// the changed entry. Entries whose hashes are exhausted are
+// kept unordered in a collision node.
+#define MU_HAMTBITS 5
+
+struct hnode {
+    uint32_t datamap;   // slots holding entries
+    uint32_t nodemap;   // slots holding subnodes
+    hash_t len;         // count of entries in node
+    tlen_t size;        // count of entries in subtrie
+    var_t array[];      // entries followed by subnodes
+};
+
+mu_inline struct hnode **hnode_nodes(struct hnode *n) {
+    return (struct hnode **)&n->array[2*n->len];
+}
+
+mu_inline hash_t hnode_rank(uint32_t map, uint32_t bit) {
+    return __builtin_popcount(map & (bit-1));
+}
+
+mu_inline size_t hnode_size(hash_t len, uint32_t nodemap) {
+    return sizeof(struct hnode) + 2*len * sizeof(var_t) +
+           __builtin_popcount(nodemap) * sizeof(struct hnode *);
+}
+
+static struct hnode *hnode_create(hash_t len, uint32_t datamap,
+                                  uint32_t nodemap, eh_t *eh) {
+    struct hnode *n = ref_alloc(hnode_size(len, nodemap), eh);
+    n->datamap = datamap;
+    n->nodemap = nodemap;
+    n->len = len;
+    n->size = len;
+
+    return n;
+}
+
+static void hnode_destroy(void *m) {
+    struct hnode *n = m;
+    hash_t i;
+
+    for (i=0; i < 2*n->len; i++)
+        var_dec(n->array[i]);
+
+    for (i=0; i < __builtin_popcount(n->nodemap); i++)
+        ref_dec(hnode_nodes(n)[i], hnode_destroy);
+
+    ref_dealloc(m, hnode_size(n->len, n->nodemap));
+}
+
+// Creates a node holding one entry
+static struct hnode *hamt_single(var_t key, var_t val, hash_t hash,
+                                 hash_t shift, eh_t *eh) {
+    uint32_t bit = shift < 32 ? 1u << ((hash >> shift) & 31) : 0;
+    struct hnode *n = hnode_create(1, bit, 0, eh);
+    n->array[0] = key;
+    n->array[1] = val;
+
+    return n;
+}
+
+// Creates a node holding two entries with different keys
+static struct hnode *hamt_merge(var_t k0, var_t v0, hash_t h0,
+                                var_t k1, var_t v1, hash_t h1,
+                                hash_t shift, eh_t *eh) {
+    if (shift >= 32) {
+        struct hnode *n = hnode_create(2, 0, 0, eh);
+        n->array[0] = k0; n->array[1] = v0;
+        n->array[2] = k1; n->array[3] = v1;
+        return n;
+    }
+
+    uint32_t b0 = 1u << ((h0 >> shift) & 31);
+    uint32_t b1 = 1u << ((h1 >> shift) & 31);
+
+    if (b0 == b1) {
+        struct hnode *n = hnode_create(0, 0, b0, eh);
+        hnode_nodes(n)[0] = hamt_merge(k0, v0, h0, k1, v1, h1,
+                                       shift + MU_HAMTBITS, eh);
+        n->size = 2;
+        return n;
+    }
+
+    struct hnode *n = hnode_create(2, b0 | b1, 0, eh);
+    hash_t i = b0 < b1 ? 0 : 1;
+    n->array[2*i  ] = k0; n->array[2*i+1] = v0;
+    n->array[2-2*i] = k1; n->array[3-2*i] = v1;
+    return n;
+}
+
+// Copies a node, optionally skipping entry or subnode
+// at rank skip, and sharing everything else
+static void hnode_copy(struct hnode *n, struct hnode *m,
+                       hash_t dskip, hash_t nskip) {
+    hash_t i, j;
+
+    for (i=0, j=0; i < n->len; i++) {
+        if (i == dskip)
+            continue;
+
+        m->array[2*j  ] = n->array[2*i  ];
+        m->array[2*j+1] = n->array[2*i+1];
+        var_inc(m->array[2*j  ]);
+        var_inc(m->array[2*j+1]);
+        j++;
+    }
+
+    for (i=0, j=0; i < __builtin_popcount(n->nodemap); i++) {
+        if (i == nskip)
+            continue;
+
+        hnode_nodes(m)[j] = hnode_nodes(n)[i];
+        ref_inc(hnode_nodes(m)[j]);
+        j++;
+    }
+}
+
+// Inserts an entry into a copy of the trie, the key and value
+// are consumed and the returned node holds one reference
+static struct hnode *hamt_insert(struct hnode *n, var_t key, var_t val,
+                                 hash_t hash, hash_t shift, eh_t *eh) {
+    hash_t i;
+
+    if (!n)
+        return hamt_single(key, val, hash, shift, eh);
+
+    if (shift >= 32) {
+        for (i=0; i < n->len; i++) {
+            if (var_equals(key, n->array[2*i]))
+                break;
+        }
+
+        struct hnode *m = hnode_create(i < n->len ? n->len : n->len+1, 
+                                       0, 0, eh);
+        hnode_copy(n, m, i, -1);
+        m->array[2*(m->len-1)  ] = key;
+        m->array[2*(m->len-1)+1] = val;
+        m->size = m->len;
+        return m;
+    }
+
+    uint32_t bit = 1u << ((hash >> shift) & 31);
+    hash_t di = hnode_rank(n->datamap, bit);
+    hash_t ni = hnode_rank(n->nodemap, bit);
+    struct hnode *m;
+
+    if (n->datamap & bit) {
+        var_t *v = &n->array[2*di];
+
+        if (var_equals(key, v[0])) {
+            m = hnode_create(n->len, n->datamap, n->nodemap, eh);
+            hnode_copy(n, m, -1, -1);
+            var_dec(m->array[2*di  ]);
+            var_dec(m->array[2*di+1]);
+            m->array[2*di  ] = key;
+            m->array[2*di+1] = val;
+            m->size = n->size;
+            return m;
+        }
+
+        // entries sharing a slot move into a new subnode
+        var_inc(v[0]);
+        var_inc(v[1]);
+        struct hnode *c = hamt_merge(v[0], v[1], var_hash(v[0]),
+                                     key, val, hash,
+                                     shift + MU_HAMTBITS, eh);
+
+        m = hnode_create(n->len-1, n->datamap & ~bit, 
+                         n->nodemap | bit, eh);
+        hnode_copy(n, m, di, -1);
+        memmove(&hnode_nodes(m)[ni+1], &hnode_nodes(m)[ni],
+                (__builtin_popcount(m->nodemap)-ni-1) * 
+                sizeof(struct hnode *));
+        hnode_nodes(m)[ni] = c;
+        m->size = n->size + 1;
+        return m;
+    } else if (n->nodemap & bit) {
+        struct hnode *o = hnode_nodes(n)[ni];
+        struct hnode *c = hamt_insert(o, key, val, hash, 
+                                      shift + MU_HAMTBITS, eh);
+
+        m = hnode_create(n->len, n->datamap, n->nodemap, eh);
+        hnode_copy(n, m, -1, ni);
+        memmove(&hnode_nodes(m)[ni+1], &hnode_nodes(m)[ni],
+                (__builtin_popcount(m->nodemap)-ni-1) * 
+                sizeof(struct hnode *));
+        hnode_nodes(m)[ni] = c;
+        m->size = n->size - o->size + c->size;
+        return m;
+    } else {
+        m = hnode_create(n->len+1, n->datamap | bit, n->nodemap, eh);
+        hnode_copy(n, m, -1, -1);
+        memmove(&m->array[2*di+2], &m->array[2*di],
+                2*(n->len-di) * sizeof(var_t));
+        m->array[2*di  ] = key;
+        m->array[2*di+1] = val;
+        m->size = n->size + 1;
+        return m;
+    }
+}
+
+// Removes an entry from a copy of the trie, returning the
+// node itself with a new reference if the key is missing
+static struct hnode *hamt_remove(struct hnode *n, var_t key,
+                                 hash_t hash, hash_t shift, eh_t *eh) {
+    hash_t i;
+    struct hnode *m;
+
+    if (shift >= 32) {
+        for (i=0; i < n->len; i++) {
+            if (var_equals(key, n->array[2*i]))
+                break;
+        }
+
+        if (i == n->len) {
+            ref_inc(n);
+            return n;
+        } else if (n->len == 1) {
+            return 0;
+        }
+
+        m = hnode_create(n->len-1, 0, 0, eh);
+        hnode_copy(n, m, i, -1);
+        return m;
+    }
+
+    uint32_t bit = 1u << ((hash >> shift) & 31);
+    hash_t di = hnode_rank(n->datamap, bit);
+    hash_t ni = hnode_rank(n->nodemap, bit);
+
+    if ((n->datamap & bit) && var_equals(key, n->array[2*di])) {
+        if (n->len == 1 && !n->nodemap)
+            return 0;
+
+        m = hnode_create(n->len-1, n->datamap & ~bit, n->nodemap, eh);
+        hnode_copy(n, m, di, -1);
+        m->size = n->size - 1;
+        return m;
+    } else if (n->nodemap & bit) {
+        struct hnode *o = hnode_nodes(n)[ni];
+        struct hnode *c = hamt_remove(o, key, hash, 
+                                      shift + MU_HAMTBITS, eh);
+
+        if (c == o) {
+            ref_dec(c, hnode_destroy);
+            ref_inc(n);
+            return n;
+        }
+
+        if (!c) {
+            if (!n->len && n->nodemap == bit)
+                return 0;
+
+            m = hnode_create(n->len, n->datamap, n->nodemap & ~bit, eh);
+            hnode_copy(n, m, -1, ni);
+        } else if (c->len == 1 && !c->nodemap) {
+            // subnodes left with a single entry are pulled up
+            m = hnode_create(n->len+1, n->datamap | bit, 
+                             n->nodemap & ~bit, eh);
+            hnode_copy(n, m, -1, ni);
+            memmove(&m->array[2*di+2], &m->array[2*di],
+                    2*(n->len-di) * sizeof(var_t));
+            m->array[2*di  ] = c->array[0];
+            m->array[2*di+1] = c->array[1];
+            var_inc(m->array[2*di  ]);
+            var_inc(m->array[2*di+1]);
+            ref_dec(c, hnode_destroy);
+        } else {
+            m = hnode_create(n->len, n->datamap, n->nodemap, eh);
+            hnode_copy(n, m, -1, ni);
+            memmove(&hnode_nodes(m)[ni+1], &hnode_nodes(m)[ni],
+                    (__builtin_popcount(m->nodemap)-ni-1) * 
+                    sizeof(struct hnode *));
+            hnode_nodes(m)[ni] = c;
+        }
+
+        m->size = n->size - 1;
+        return m;
+    } else {
+        ref_inc(n);
+        return n;
+    }
+}
+
+// Looks up a key in the trie
+static var_t hamt_lookup(struct hnode *n, var_t key, hash_t hash) {
+    hash_t i, shift = 0;
+
+    while (n) {
+        if (shift >= 32) {
+            for (i=0; i < n->len; i++) {
+                if (var_equals(key, n->array[2*i]))
+                    return n->array[2*i+1];
+            }
+
+            return vnil;
+        }
+
+        uint32_t bit = 1u << ((hash >> shift) & 31);
+
+        if (n->datamap & bit) {
+            var_t *v = &n->array[2*hnode_rank(n->datamap, bit)];
+            return var_equals(key, v[0]) ? v[1] : vnil;
+        } else if (n->nodemap & bit) {
+            n = hnode_nodes(n)[hnode_rank(n->nodemap, bit)];
+            shift += MU_HAMTBITS;
+        } else {
+            return vnil;
+        }
+    }
+
+    return vnil;
+}
+
+// Finds the entry at a position in the trie's order
+static var_t *hamt_nth(struct hnode *n, tlen_t i) {
+    while (i >= n->len) {
+        struct hnode **nodes = hnode_nodes(n);
+        i -= n->len;
+
+        for (; i >= (*nodes)->size; nodes++)
+            i -= (*nodes)->size;
+
+        n = *nodes;
+    }
+
+    return &n->array[2*i];
+}
+
+// Creates a persistent table owning a trie
+static tbl_t *tbl_hamt(struct hnode *root, eh_t *eh) {
+    tbl_t *tbl = tbl_create(0, eh);
+
+    tbl->stride = TBL_HAMT;
+    tbl->mask = 0;
+    tbl->root = root;
+    tbl->len = root ? root->size : 0;
+
+    return tbl;
+}
+
+
+// Called by the cycle collector. Persistent tables only visit
+// trie nodes they own alone, shared nodes are treated as
+// references from outside the tables that share them
+static void hnode_visit(struct hnode *n, void (*visit)(var_t)) {
+    hash_t i;
+
+    for (i=0; i < 2*n->len; i++)
+        visit(n->array[i]);
+
+    for (i=0; i < __builtin_popcount(n->nodemap); i++) {
+        struct hnode *c = hnode_nodes(n)[i];
+
+        if (*ref_get(c) == 1)
+            hnode_visit(c, visit);
+    }
+}
+
+void tbl_visit(var_t v, void (*visit)(var_t)) {
+    tbl_t *tbl = tbl_read(gettbl(v));
+
+    if (tbl->stride == TBL_SLICE) {
+        visit(vtbl(tbl->base));
+    } else if (tbl->stride == TBL_TREE) {
+        hash_t i, j;
+
+        for (i=0; i < tbl->count; i++) {
+            struct leaf *l = tbl->leaves[i];
+
+            for (j=0; j < 2*l->len; j++)
+                visit(l->array[j]);
+        }
+    } else if (tbl->stride == TBL_HAMT) {
+        if (tbl->root && *ref_get(tbl->root) == 1)
+            hnode_visit(tbl->root, visit);
+    } else if (tbl->stride == TBL_LIST) {
+        tlen_t i;
+
+        for (i=0; i < tbl->len; i++)
+            visit(tbl->array[i]);
+    } else if (tbl->stride == TBL_HASH) {
+        hash_t i;
+
+        for (i=0; i < 2*(tbl->mask+1); i++)
+            visit(tbl->array[i]);
+    }
+
+    if (tbl->tail)
+        visit(vtbl(tbl->tail));
+}
+
+void tbl_clear(var_t v) {
+    tbl_t *tbl = tbl_read(gettbl(v));
+    tbl_empty(tbl);
+
+    tbl->tail = 0;
+    tbl->stride = TBL_RANGE;
+    tbl->nils = 0;
+    tbl->len = 0;
+    tbl->mask = 0;
+    tbl->offset = 0;
+    tbl->step = 1;
+}
+
+
 // Recursively looks up a key in the table
 // returns either that value or nil
 var_t tbl_lookup(tbl_t *tbl, var_t key) {
     if (isnil(key))
         return vnil;
 
-    hash_t i, hash = var_hash(key);
+    hash_t hash = var_hash(key);
 
     for (tbl = tbl_read(tbl); tbl; tbl = tbl_read(tbl->tail)) {
-        if (tbl->stride < 2) {
-            if (num_ishash(key, hash) && hash < tbl->len) {
-                if (tbl->stride == 0)
-                    return vnum(hash + tbl->offset);
-                else
-                    return tbl->array[hash];
-            }
-        } else {
-            for (i = hash;; i = tbl_next(i)) {
-                hash_t mi = i & tbl->mask;
-                var_t *v = &tbl->array[2*mi];
+        if (tbl->stride < TBL_HASH) {
+            if (num_ishash(key, hash) && hash < tbl->len)
+                return tbl_index(tbl, hash);
+        } else if (tbl->stride == TBL_TREE) {
+            var_t *v = tree_find(tbl, key);
+
+            if (v)
+                return v[1];
+        } else if (tbl->stride == TBL_HAMT) {
+            var_t val = hamt_lookup(tbl->root, key, hash);
+
+            if (!isnil(val))
+                return val;
+        } else if (tbl_maybe(tbl, hash)) {
+            var_t *v = tbl_find(tbl, key, hash);
+
+            if (v && !isnil(v[1]))
+                return v[1];
+        }
+    }
 
-                if (isnil(v[0]))
-                    break;
+    return vnil;
+}
 
-                if (var_equals(key, v[0]) && !isnil(v[1]))
-                    return v[1];
-            }
+
+// Looks up a batch of keys in a single table, keys still
+// missing are left in the pending list for the tail
+static tlen_t tbl_lookup_batch(tbl_t *tbl, const var_t *keys, var_t *vals,
+                               tlen_t *pending, hash_t *hashes, tlen_t n) {
+    tlen_t i, m = 0;
+
+    // first pass issues prefetches for each key's home slot
+    for (i=0; i < n; i++) {
+        hash_t hash = hashes[i];
+
+        if (tbl->stride == TBL_LIST) {
+            if (hash < tbl->len)
+                mu_prefetch(&tbl->array[hash]);
+        } else if (tbl->stride == TBL_NUMS) {
+            if (hash < tbl->len)
+                mu_prefetch(&tbl->nums[hash]);
+        } else if (tbl->stride == TBL_HASH && tbl_maybe(tbl, hash)) {
+            mu_prefetch(&tbl->array[2*(tbl_mix(hash) & tbl->mask)]);
         }
     }
 
-    return vnil;
+    // second pass probes with the slots hopefully in cache
+    for (i=0; i < n; i++) {
+        var_t key = keys[pending[i]];
+        hash_t hash = hashes[i];
+        var_t val = vnil;
+
+        if (tbl->stride < TBL_HASH) {
+            if (num_ishash(key, hash) && hash < tbl->len)
+                val = tbl_index(tbl, hash);
+        } else if (tbl->stride == TBL_TREE) {
+            var_t *v = tree_find(tbl, key);
+
+            if (v)
+                val = v[1];
+        } else if (tbl->stride == TBL_HAMT) {
+            val = hamt_lookup(tbl->root, key, hash);
+        } else if (tbl_maybe(tbl, hash)) {
+            var_t *v = tbl_find(tbl, key, hash);
+
+            if (v)
+                val = v[1];
+        }
+
+        if (!isnil(val)) {
+            vals[pending[i]] = val;
+        } else {
+            pending[m] = pending[i];
+            hashes[m] = hash;
+            m++;
+        }
+    }
+
+    return m;
+}
+
+// Looks up many keys at once, storing each value or nil
+void tbl_lookup_many(tbl_t *head, const var_t *keys, var_t *vals, tlen_t n) {
+    tlen_t pending[MU_TBLBATCH];
+    hash_t hashes[MU_TBLBATCH];
+    tlen_t off, i;
+
+    head = tbl_read(head);
+
+    for (off = 0; off < n; off += MU_TBLBATCH) {
+        tlen_t m = 0;
+        tbl_t *tbl;
+
+        for (i = off; i < n && i < off+MU_TBLBATCH; i++) {
+            vals[i] = vnil;
+
+            if (isnil(keys[i]))
+                continue;
+
+            pending[m] = i;
+            hashes[m] = var_hash(keys[i]);
+            m++;
+        }
+
+        for (tbl = head; tbl && m > 0; tbl = tbl_read(tbl->tail))
+            m = tbl_lookup_batch(tbl, keys, vals, pending, hashes, m);
+    }
 }
 
 
@@ -110,13 +987,9 @@ var_t tbl_lookup(tbl_t *tbl, var_t key) {
 var_t tbl_lookdn(tbl_t *tbl, var_t key, len_t i) {
     tbl = tbl_read(tbl);
 
-    if (!tbl->tail && tbl->stride < 2) {
-        if (i < tbl->len) {
-            if (tbl->stride == 0)
-                return vnum(i + tbl->offset);
-            else
-                return tbl->array[i];
-        }
+    if (!tbl->tail && tbl->stride < TBL_HASH) {
+        if (i < tbl->len)
+            return tbl_index(tbl, i);
 
         return vnil;
     } else {
@@ -125,110 +998,233 @@ var_t tbl_lookdn(tbl_t *tbl, var_t key, len_t i) {
         if (!isnil(val))
             return val;
 
-        return tbl_lookup(tbl, vnum(i));
+        return tbl_lookup(tbl, vnum(i));
+    }
+}
+
+
+// releases storage of tables with implicit keys
+// once their entries have been moved elsewhere
+static void tbl_release(tbl_t *tbl) {
+    if (tbl->stride == TBL_SLICE)
+        tbl_dec(tbl->base);
+    else if (tbl->stride != TBL_RANGE)
+        tbl_dealloc(tbl, tbl->array, (tbl->mask+1) * tbl_entry(tbl));
+}
+
+// converts implicit range to packed array of nums on heap
+static void tbl_realizenums(tbl_t *tbl, eh_t *eh) {
+    hash_t cap = tbl->mask + 1;
+    num_t *w = tbl_alloc(tbl, cap * sizeof(num_t), eh);
+    int i;
+
+    for (i=0; i < tbl->len; i++) {
+        w[i] = tbl->offset + (num_t)i*tbl->step;
     }
-}
 
+    tbl->nums = w;
+    tbl->stride = TBL_NUMS;
+}
 
-// converts implicit range to actual array of nums on heap
+// converts implicit entries or packed nums to array of vars
+// small tables are converted in place one entry at a time
 static void tbl_realizevars(tbl_t *tbl, eh_t *eh) {
     hash_t cap = tbl->mask + 1;
-    var_t *w = mu_alloc(cap * sizeof(var_t), eh);
+    var_t *w = tbl_alloc(tbl, cap * sizeof(var_t), eh);
     int i;
 
     for (i=0; i < tbl->len; i++) {
-        w[i] = vnum(i + tbl->offset);
+        w[i] = tbl_index(tbl, i);
+        var_inc(w[i]);
     }
 
+    tbl_release(tbl);
     tbl->array = w;
-    tbl->stride = 1;
+    tbl->stride = TBL_LIST;
 }
 
+// converts implicit keys to hashed keys, placing each index
+// where lookups probe for it, small tables are read from a
+// copy since the hashed entries may reuse the inline slots
 static void tbl_realizekeys(tbl_t *tbl, eh_t *eh) {
     hash_t cap = tbl->mask + 1;
-    var_t *w = mu_alloc(2*cap * sizeof(var_t), eh);
-    int i;
+    tbl_t *src = tbl;
+    tbl_t copy;
 
-    if (tbl->stride == 0) {
-        for (i=0; i < tbl->len; i++) {
-            w[2*i  ] = vnum(i);
-            w[2*i+1] = vnum(i + tbl->offset);
-        }
-    } else {
-        for (i=0; i < tbl->len; i++) {
-            w[2*i  ] = vnum(i);
-            w[2*i+1] = tbl->array[i];
+    if (tbl->stride >= TBL_NUMS && tbl->array == tbl->slots) {
+        copy = *tbl;
+        copy.array = copy.slots;
+        src = &copy;
+    }
+
+    var_t *w = tbl_alloc(tbl, 2*cap * sizeof(var_t), eh);
+    memset(w, 0, 2*cap * sizeof(var_t));
+    hash_t i, j;
+
+    for (j=0; j < tbl->len; j++) {
+        var_t k = vnum(j);
+        var_t v = tbl_index(src, j);
+        hash_t hash = var_hash(k);
+
+        if (tbl->stride == TBL_SLICE)
+            var_inc(v);
+
+        var_t *u = &w[2*j];
+
+        if (w != tbl->slots) {
+            for (i = tbl_mix(hash);; i = tbl_next(i)) {
+                u = &w[2*(i & tbl->mask)];
+
+                if (isnil(u[0]))
+                    break;
+            }
         }
 
-        mu_dealloc(tbl->array, cap * sizeof(var_t));
+        u[0] = k;
+        u[1] = v;
     }
 
-    memset(w + 2*tbl->len, 0, 2*(cap - tbl->len) * sizeof(var_t));
+    // the filter shares space with the fields of slices
+    tbl_release(tbl);
     tbl->array = w;
-    tbl->stride = 2;
+    tbl->nils = 0;
+    tbl->stride = TBL_HASH;
+    tbl_refilter(tbl);
 }
 
 
 // reallocates and rehashes a table
-mu_inline void tbl_resize(tbl_t * tbl, len_t size, eh_t *eh) {
+mu_inline void tbl_resize(tbl_t * tbl, tlen_t size, eh_t *eh) {
+    if (size > MU_MAXTLEN)
+        err_len(eh);
+
     hash_t cap = mu_npw2(tbl_ncap(size));
     hash_t mask = cap - 1;
 
-    if (tbl->stride < 2) {
-        if (tbl->stride == 0) {
+    if (tbl->stride == TBL_HASH && size <= MU_TBLSCAN) {
+        cap = MU_TBLSCAN;
+        mask = cap - 1;
+    }
+
+    if (tbl->stride < TBL_HASH) {
+        if (tbl->stride < TBL_NUMS) {
             tbl->mask = mask;
             return;
         }
 
-        var_t *w = mu_alloc(cap * sizeof(var_t), eh);
-        memcpy(w, tbl->array, tbl->len * sizeof(var_t));
+        size_t size = tbl_entry(tbl);
+        void *w = tbl_alloc(tbl, cap * size, eh);
+
+        if (w != tbl->array) {
+            memcpy(w, tbl->array, tbl->len * size);
+            tbl_dealloc(tbl, tbl->array, (tbl->mask+1) * size);
+        }
 
-        mu_dealloc(tbl->array, (tbl->mask+1) * sizeof(var_t));
         tbl->array = w;
         tbl->mask = mask;
     } else {
-        var_t *w = mu_alloc(2*cap * sizeof(var_t), eh);
+        var_t slots[MU_TBLSLOTS];
+        var_t *array = tbl->array;
+
+        // rehashing inline slots needs a copy to read from
+        if (array == tbl->slots) {
+            memcpy(slots, array, sizeof slots);
+            array = slots;
+        }
+
+        var_t *w = tbl_alloc(tbl, 2*cap * sizeof(var_t), eh);
         memset(w, 0, 2*cap * sizeof(var_t));
 
-        hash_t i, j;
+        hash_t i, j, n = 0;
 
         for (j=0; j <= tbl->mask; j++) {
-            var_t *u = &tbl->array[2*j];
+            var_t *u = &array[2*j];
 
             if (isnil(u[0]) || isnil(u[1]))
                 continue;
 
-            for (i = var_hash(u[0]);; i = tbl_next(i)) {
-                hash_t mi = i & mask;
-                var_t *v = &w[2*mi];
+            hash_t hash = var_hash(u[0]);
+            var_t *v = &w[2*n++];
 
-                if (isnil(v[0])) {
-                    v[0] = u[0];
-                    v[1] = u[1];
-                    break;
+            if (w != tbl->slots) {
+                for (i = tbl_mix(hash);; i = tbl_next(i)) {
+                    v = &w[2*(i & mask)];
+
+                    if (isnil(v[0]))
+                        break;
                 }
             }
+
+            v[0] = u[0];
+            v[1] = u[1];
         }
 
-        mu_dealloc(tbl->array, 2*(tbl->mask+1) * sizeof(var_t));
+        tbl_dealloc(tbl, tbl->array, 2*(tbl->mask+1) * sizeof(var_t));
         tbl->array = w;
         tbl->nils = 0;
         tbl->mask = mask;
+        tbl_refilter(tbl);
+    }
+}
+
+
+// Sets an index in a table with implicit keys, moving
+// to a more general stride if the value requires it
+static void tbl_setindex(tbl_t *tbl, hash_t i, var_t val, eh_t *eh) {
+    if (tbl->stride == TBL_RANGE) {
+        // the first two entries determine the range
+        if (isnum(val) && i == tbl->len && i < 2) {
+            if (i == 0)
+                tbl->offset = num_hash(val);
+            else
+                tbl->step = (int)num_hash(val) - tbl->offset;
+        }
+
+        if (tbl_inrange(tbl, i, val))
+            return;
+
+        if (isnum(val))
+            tbl_realizenums(tbl, eh);
+        else
+            tbl_realizevars(tbl, eh);
+    } else if (tbl->stride == TBL_SLICE) {
+        tbl_realizevars(tbl, eh);
+    }
+
+    if (tbl->stride == TBL_NUMS) {
+        if (isnum(val)) {
+            tbl->nums[i] = getnum(val);
+            return;
+        }
+
+        tbl_realizevars(tbl, eh);
     }
+
+    if (i < tbl->len)
+        var_dec(tbl->array[i]);
+
+    tbl->array[i] = val;
 }
     
 
 // Inserts a value in the table with the given key
 // without decending down the tail chain
 static void tbl_insertnil(tbl_t *tbl, var_t key, var_t val, eh_t *eh) {
-    hash_t i, hash = var_hash(key);
+    hash_t hash = var_hash(key);
+
+    if (tbl->stride == TBL_TREE) {
+        tree_remove(tbl, key);
+        return;
+    } else if (tbl->stride == TBL_HAMT) {
+        err_readonly(eh);
+    }
 
-    if (tbl->stride < 2) {
+    if (tbl->stride < TBL_HASH) {
         if (!num_ishash(key, hash) || hash >= tbl->len)
             return;
 
         if (hash == tbl->len - 1) {
-            if (tbl->stride != 0)
+            if (tbl->stride == TBL_LIST)
                 var_dec(tbl->array[hash]);
 
             tbl->len--;
@@ -238,63 +1234,38 @@ static void tbl_insertnil(tbl_t *tbl, var_t key, var_t val, eh_t *eh) {
         tbl_realizekeys(tbl, eh);
     }
 
-    for (i = hash;; i = tbl_next(i)) {
-        hash_t mi = i & tbl->mask;
-        var_t *v = &tbl->array[2*mi];
-
-        if (isnil(v[0]))
-            return;
-
-        if (var_equals(key, v[0])) {
-            if (!isnil(v[1])) {
-                var_dec(v[1]);
-                v[1] = vnil;
-                tbl->nils++;
-                tbl->len--;
-            }
+    var_t *v = tbl_find(tbl, key, hash);
 
-            return;
-        }
+    if (v && !isnil(v[1])) {
+        var_dec(v[1]);
+        v[1] = vnil;
+        tbl->nils++;
+        tbl->len--;
     }
 }
 
 
 static void tbl_insertval(tbl_t *tbl, var_t key, var_t val, eh_t *eh) {
-    hash_t i, hash = var_hash(key);
+    hash_t hash = var_hash(key);
+
+    if (tbl->stride == TBL_TREE) {
+        tree_insert(tbl, key, val, eh);
+        return;
+    } else if (tbl->stride == TBL_HAMT) {
+        err_readonly(eh);
+    }
 
-    if (tbl_ncap(tbl->nils+tbl->len + 1) > tbl->mask + 1)
+    if (!tbl_room(tbl, tbl->nils+tbl->len + 1))
         tbl_resize(tbl, tbl->len + 1, eh);
 
-    if (tbl->stride < 2) {
+    if (tbl->stride < TBL_HASH) {
         if (num_ishash(key, hash)) {
             if (hash == tbl->len) {
-                if (tbl->stride == 0) {
-                    if (isnum(val)) {
-                        if (tbl->len == 0)
-                            tbl->offset = num_hash(val);
-
-                        if (num_ishash(val, hash + tbl->offset)) {
-                            tbl->len++;
-                            return;
-                        }
-                    }
-
-                    tbl_realizevars(tbl, eh);
-                }
-
-                tbl->array[hash] = val;
+                tbl_setindex(tbl, hash, val, eh);
                 tbl->len++;
                 return;
             } else if (hash < tbl->len) {
-                if (tbl->stride == 0) {
-                    if (num_ishash(val, hash + tbl->offset))
-                        return;
-
-                    tbl_realizevars(tbl, eh);
-                }
-
-                var_dec(tbl->array[hash]);
-                tbl->array[hash] = val;
+                tbl_setindex(tbl, hash, val, eh);
                 return;
             }
         }
@@ -302,43 +1273,45 @@ static void tbl_insertval(tbl_t *tbl, var_t key, var_t val, eh_t *eh) {
         tbl_realizekeys(tbl, eh);
     }
 
-    for (i = hash;; i = tbl_next(i)) {
-        hash_t mi = i & tbl->mask;
-        var_t *v = &tbl->array[2*mi];
-
-        if (isnil(v[0])) {
-            v[0] = key;
-            v[1] = val;
-            tbl->len++;
-            return;
-        }
+    var_t *v = tbl_find(tbl, key, hash);
 
-        if (var_equals(key, v[0])) {
-            if (isnil(v[1])) {
-                v[1] = val;
-                tbl->nils--;
-                tbl->len++;
-            } else {
-                var_dec(v[1]);
-                v[1] = val;
-            }
+    if (isnil(v[0])) {
+        v[0] = key;
+        v[1] = val;
+        tbl_filter(tbl, hash);
+        tbl->len++;
+        return;
+    }
 
-            return;
-        }
+    if (isnil(v[1])) {
+        v[1] = val;
+        tbl->nils--;
+        tbl->len++;
+    } else {
+        var_dec(v[1]);
+        v[1] = val;
     }
+
+    var_dec(key);
 }
     
 
+// Tables take over the references of keys and values
+// passed in, releasing any that end up not being stored
 void tbl_insert(tbl_t *tbl, var_t key, var_t val, eh_t *eh) {
     tbl = tbl_write(tbl, eh);
 
-    if (isnil(key))
+    if (isnil(key)) {
+        var_dec(val);
         return;
+    }
 
-    if (isnil(val))
+    if (isnil(val)) {
         tbl_insertnil(tbl, key, val, eh);
-    else
+        var_dec(key);
+    } else {
         tbl_insertval(tbl, key, val, eh);
+    }
 }
 
 
@@ -348,21 +1321,223 @@ void tbl_append(tbl_t *tbl, var_t val, eh_t *eh) {
 }
 
 
+// Returns a new list of the numbers in a list stored as packed
+// nums, errors on other tables
+tbl_t *tbl_packcopy(tbl_t *tbl, eh_t *eh) {
+    tbl = tbl_read(tbl);
+
+    if (tbl->stride >= TBL_HASH)
+        err_undefined(eh);
+
+    tbl_t *res = tbl_create(tbl->len, eh);
+    num_t *w = tbl_alloc(res, (res->mask+1) * sizeof(num_t), eh);
+    tlen_t i;
+
+    res->nums = w;
+    res->stride = TBL_NUMS;
+
+    for (i=0; i < tbl->len; i++) {
+        var_t v = tbl_index(tbl, i);
+
+        if (!isnum(v)) {
+            tbl_dec(res);
+            err_undefined(eh);
+        }
+
+        w[i] = getnum(v);
+        res->len++;
+    }
+
+    return res;
+}
+
+// Returns a list of packed nums with the numbers in a list, which
+// is the list itself if already packed, leaving other lists as is
+tbl_t *tbl_packed(tbl_t *tbl, eh_t *eh) {
+    tbl = tbl_read(tbl);
+
+    if (tbl->stride != TBL_NUMS)
+        return tbl_packcopy(tbl, eh);
+
+    tbl_inc(tbl);
+    return tbl;
+}
+
+
+// Creates a persistent table holding the entries of a table
+tbl_t *tbl_persist(tbl_t *tbl, eh_t *eh) {
+    tbl = tbl_read(tbl);
+
+    if (tbl->stride == TBL_HAMT) {
+        tbl_inc(tbl);
+        return tbl;
+    }
+
+    struct hnode *root = 0;
+
+    tbl_for_begin (k, v, tbl) {
+        struct hnode *n;
+
+        var_inc(k);
+        var_inc(v);
+        n = hamt_insert(root, k, v, var_hash(k), 0, eh);
+
+        if (root)
+            ref_dec(root, hnode_destroy);
+
+        root = n;
+    } tbl_for_end;
+
+    return tbl_hamt(root, eh);
+}
+
+// Returns a persistent table with the key set to the value,
+// or removed if the value is nil, sharing unchanged entries
+tbl_t *tbl_with(tbl_t *tbl, var_t key, var_t val, eh_t *eh) {
+    tbl_t *base = tbl_persist(tbl, eh);
+    struct hnode *root;
+
+    if (isnil(key)) {
+        var_dec(val);
+        return base;
+    }
+
+    if (isnil(val)) {
+        root = base->root ? 
+               hamt_remove(base->root, key, var_hash(key), 0, eh) : 0;
+        var_dec(key);
+    } else {
+        root = hamt_insert(base->root, key, val, var_hash(key), 0, eh);
+    }
+
+    tbl_dec(base);
+    return tbl_hamt(root, eh);
+}
+
+
+// Sets the tail of a table, the tail starts keeping
+// a filter of its keys the first time it is used as one
+void tbl_settail(tbl_t *tbl, tbl_t *tail) {
+    tbl->tail = tail;
+
+    if (!tail)
+        return;
+
+    tail = tbl_read(tail);
+
+    if (!tail->tailed) {
+        tail->tailed = true;
+        tbl_refilter(tail);
+    }
+}
+
+
+// Returns the smallest key not less than the given key
+// or nil if there is none
+var_t tbl_lower(tbl_t *tbl, var_t key) {
+    tbl = tbl_read(tbl);
+
+    if (tbl->stride == TBL_TREE) {
+        hash_t i = tree_leaf(tbl, key);
+
+        if (i >= tbl->count)
+            return vnil;
+
+        struct leaf *l = tbl->leaves[i];
+        return l->array[2*leaf_lower(l, key)];
+    }
+
+    var_t lower = vnil;
+
+    tbl_for_begin (k, v, tbl) {
+        if (var_compare(k, key) >= 0 && 
+            (isnil(lower) || var_compare(k, lower) < 0))
+            lower = k;
+    } tbl_for_end;
+
+    return lower;
+}
+
+
+// Returns a sorted table of the entries with keys in
+// the range [lo, hi), nil bounds are unbounded
+tbl_t *tbl_between(tbl_t *tbl, var_t lo, var_t hi, eh_t *eh) {
+    tbl_t *res = tbl_sorted(eh);
+    tbl = tbl_read(tbl);
+
+    if (tbl->stride != TBL_TREE) {
+        tbl_for_begin (k, v, tbl) {
+            if ((isnil(lo) || var_compare(k, lo) >= 0) &&
+                (isnil(hi) || var_compare(k, hi) < 0)) {
+                var_inc(k);
+                var_inc(v);
+                tree_insert(res, k, v, eh);
+            }
+        } tbl_for_end;
+
+        return res;
+    }
+
+    // entries are already ordered so they are copied
+    // directly into full leaves of the result
+    hash_t i = isnil(lo) ? 0 : tree_leaf(tbl, lo);
+    hash_t j = (isnil(lo) || i >= tbl->count) ? 0 : 
+               leaf_lower(tbl->leaves[i], lo);
+    struct leaf *r = 0;
+
+    for (; i < tbl->count; i++, j = 0) {
+        struct leaf *l = tbl->leaves[i];
+
+        for (; j < l->len; j++) {
+            var_t *v = &l->array[2*j];
+
+            if (!isnil(hi) && var_compare(v[0], hi) >= 0)
+                return res;
+
+            if (!r || r->len == MU_LEAFLEN)
+                r = tree_addleaf(res, res->count, eh);
+
+            var_inc(v[0]);
+            var_inc(v[1]);
+            r->array[2*r->len  ] = v[0];
+            r->array[2*r->len+1] = v[1];
+            r->len++;
+            res->len++;
+        }
+    }
+
+    return res;
+}
+
+
 // Recursively assigns a value in the table with the given key
 // decends down the tail chain until its found
 static void tbl_assignnil(tbl_t *tbl, var_t key, var_t val, eh_t *eh) {
-    hash_t i, hash = var_hash(key);
+    hash_t hash = var_hash(key);
 
     for (; tbl; tbl = tbl->tail) {
         if (tbl_isro(tbl))
             break;
 
-        if (tbl->stride < 2) {
+        if (tbl->stride == TBL_TREE) {
+            if (!tree_find(tbl, key))
+                continue;
+
+            tree_remove(tbl, key);
+            return;
+        } else if (tbl->stride == TBL_HAMT) {
+            if (isnil(hamt_lookup(tbl->root, key, hash)))
+                continue;
+
+            err_readonly(eh);
+        }
+
+        if (tbl->stride < TBL_HASH) {
             if (!num_ishash(key, hash) || hash >= tbl->len)
                 continue;
 
             if (hash == tbl->len - 1) {
-                if (tbl->stride != 0)
+                if (tbl->stride == TBL_LIST)
                     var_dec(tbl->array[hash]);
 
                 tbl->len--;
@@ -372,93 +1547,84 @@ static void tbl_assignnil(tbl_t *tbl, var_t key, var_t val, eh_t *eh) {
             tbl_realizekeys(tbl, eh);
         }
 
-        for (i = hash;; i = tbl_next(i)) {
-            hash_t mi = i & tbl->mask;
-            var_t *v = &tbl->array[2*mi];
-
-            if (isnil(v[0])) 
-                break;
+        if (!tbl_maybe(tbl, hash))
+            continue;
 
-            if (var_equals(key, v[0])) {
-                if (isnil(v[1]))
-                    break;
+        var_t *v = tbl_find(tbl, key, hash);
 
-                var_dec(v[1]);
-                v[1] = vnil;
-                tbl->nils++;
-                tbl->len--;
-                return;
-            }
+        if (v && !isnil(v[1])) {
+            var_dec(v[1]);
+            v[1] = vnil;
+            tbl->nils++;
+            tbl->len--;
+            return;
         }
     }
 }
 
 
 static void tbl_assignval(tbl_t *head, var_t key, var_t val, eh_t *eh) {
-    hash_t i, hash = var_hash(key);
+    hash_t hash = var_hash(key);
     tbl_t *tbl = head;
 
     for (; tbl; tbl = tbl->tail) {
         if (tbl_isro(tbl))
             break;
 
-        if (tbl->stride < 2) {
-            if (!num_ishash(key, hash) || hash >= tbl->len)
+        if (tbl->stride == TBL_TREE) {
+            var_t *v = tree_find(tbl, key);
+
+            if (!v)
+                continue;
+
+            var_dec(v[1]);
+            v[1] = val;
+            var_dec(key);
+            return;
+        } else if (tbl->stride == TBL_HAMT) {
+            if (isnil(hamt_lookup(tbl->root, key, hash)))
                 continue;
 
-            if (tbl->stride == 0) {
-                if (num_ishash(val, hash + tbl->offset))
-                    return;
+            err_readonly(eh);
+        }
 
-                tbl_realizevars(tbl, eh);
-            }
+        if (tbl->stride < TBL_HASH) {
+            if (!num_ishash(key, hash) || hash >= tbl->len)
+                continue;
 
-            var_dec(tbl->array[hash]);
-            tbl->array[hash] = val;
+            tbl_setindex(tbl, hash, val, eh);
             return;
         }
 
-        for (i = hash;; i = tbl_next(i)) {
-            hash_t mi = i & tbl->mask;
-            var_t *v = &tbl->array[2*mi];
-
-            if (isnil(v[0]))
-                break;
+        if (!tbl_maybe(tbl, hash))
+            continue;
 
-            if (var_equals(key, v[0])) {
-                if (isnil(v[1]))
-                    break;
+        var_t *v = tbl_find(tbl, key, hash);
 
-                var_dec(v[1]);
-                v[1] = val;
-                return;
-            }
+        if (v && !isnil(v[1])) {
+            var_dec(v[1]);
+            v[1] = val;
+            var_dec(key);
+            return;
         }
     }
 
 
     tbl = tbl_write(head, eh);
 
-    if (tbl_ncap(tbl->len+tbl->nils + 1) > tbl->mask + 1)
+    if (tbl->stride == TBL_TREE) {
+        tree_insert(tbl, key, val, eh);
+        return;
+    } else if (tbl->stride == TBL_HAMT) {
+        err_readonly(eh);
+    }
+
+    if (!tbl_room(tbl, tbl->len+tbl->nils + 1))
         tbl_resize(tbl, tbl->len+1, eh);
 
-    if (tbl->stride < 2) {
+    if (tbl->stride < TBL_HASH) {
         if (num_ishash(key, hash) && hash == tbl->len) {
-            if (tbl->stride == 0) {
-                if (isnum(val)) {
-                    if (tbl->len == 0)
-                        tbl->offset = num_hash(val);
-
-                    if (num_ishash(val, hash + tbl->offset)) {
-                        tbl->len++;
-                        return;
-                    }
-                }
-
-                tbl_realizevars(tbl, eh);
-            }
-
-            tbl->array[hash] = val;
+            tbl_setindex(tbl, hash, val, eh);
             tbl->len++;
             return;
         }
@@ -466,168 +1632,135 @@ static void tbl_assignval(tbl_t *head, var_t key, var_t val, eh_t *eh) {
         tbl_realizekeys(tbl, eh);
     }
 
-    for (i = hash;; i = tbl_next(i)) {
-        hash_t mi = i & tbl->mask;
-        var_t *v = &tbl->array[2*mi];
-
-        if (isnil(v[0])) {
-            v[0] = key;
-            v[1] = val;
-            tbl->len++;
-            return;
-        }
+    var_t *v = tbl_find(tbl, key, hash);
 
-        if (var_equals(key, v[0]) && isnil(v[1])) {
-            v[1] = val;
-            tbl->nils--;
-            tbl->len++;
-            return;
-        }
+    if (isnil(v[0])) {
+        v[0] = key;
+        v[1] = val;
+        tbl_filter(tbl, hash);
+        tbl->len++;
+        return;
     }
+
+    v[1] = val;
+    tbl->nils--;
+    tbl->len++;
+    var_dec(key);
 }
 
 
 void tbl_assign(tbl_t *tbl, var_t key, var_t val, eh_t *eh) {
-    if (isnil(key))
+    if (isnil(key)) {
+        var_dec(val);
         return;
+    }
 
-    if (isnil(val))
+    if (isnil(val)) {
         tbl_assignnil(tbl, key, val, eh);
-    else
+        var_dec(key);
+    } else {
         tbl_assignval(tbl, key, val, eh);
+    }
 }
 
 
 
 // Performs iteration on a table
-mu_fn var_t tbl_0_iteration(tbl_t *args, tbl_t *scope, eh_t *eh) {
-    tbl_t *tbl = gettbl(tbl_lookup(scope, vnum(0)));
-    tbl_t *ret = gettbl(tbl_lookup(scope, vnum(1)));
-    int i = getraw(tbl_lookup(scope, vnum(2)));
-
-    if (i >= tbl->len)
-        return vnil;
-
-    tbl_insert(ret, vnum(0), vnum(tbl->offset + i), eh);
-    tbl_insert(ret, vnum(1), vnum(i), eh);
-    tbl_insert(ret, vnum(2), vnum(i), eh);
-
-    i += 1;
-    tbl_insert(scope, vnum(2), vraw(i), eh);
-
-    return vtbl(ret);
+void tbl_iter(var_t v, iter_t *it, eh_t *eh) {
+    it->tbl = tbl_read(gettbl(v));
+    it->i = 0;
+    it->j = 0;
 }
 
-mu_fn var_t tbl_1_iteration(tbl_t *args, tbl_t *scope, eh_t *eh) {
-    tbl_t *tbl = gettbl(tbl_lookup(scope, vnum(0)));
-    tbl_t *ret = gettbl(tbl_lookup(scope, vnum(1)));
-    int i = getraw(tbl_lookup(scope, vnum(2)));
-
-    if (i >= tbl->len)
-        return vnil;
-
-    tbl_insert(ret, vnum(0), tbl->array[i], eh);
-    tbl_insert(ret, vnum(1), vnum(i), eh);
-    tbl_insert(ret, vnum(2), vnum(i), eh);
+// Steps an iterator, storing the next key and value
+// returns false once the table has been exhausted
+bool tbl_iter_next(iter_t *it, var_t *k, var_t *v) {
+    tbl_t *tbl = it->tbl;
+
+    if (it->i >= tbl->len)
+        return false;
+
+    switch (tbl->stride) {
+        case TBL_RANGE:
+        case TBL_SLICE:
+        case TBL_NUMS:
+        case TBL_LIST:
+            *k = vnum(it->i);
+            *v = tbl_index(tbl, it->i);
+            break;
 
-    i += 1;
-    tbl_insert(scope, vnum(2), vraw(i), eh);
+        case TBL_HASH:
+            do {
+                if (it->j > tbl->mask)
+                    return false;
 
-    return vtbl(ret);
-}
+                *k = tbl->array[2*it->j  ];
+                *v = tbl->array[2*it->j+1];
 
-mu_fn var_t tbl_2_iteration(tbl_t *args, tbl_t *scope, eh_t *eh) {
-    tbl_t *tbl = gettbl(tbl_lookup(scope, vnum(0)));
-    tbl_t *ret = gettbl(tbl_lookup(scope, vnum(1)));
-    int i = getraw(tbl_lookup(scope, vnum(2)));
-    int j = getraw(tbl_lookup(scope, vnum(3)));
-    var_t k, v;
+                it->j += 1;
+            } while (isnil(*k) || isnil(*v));
+            break;
 
-    if (i >= tbl->len)
-        return vnil;
+        case TBL_TREE:
+            // j holds the leaf index and offset into the leaf
+            while (true) {
+                hash_t l = it->j >> MU_LEAFBITS;
+                hash_t o = it->j & (MU_LEAFLEN-1);
 
-    do {
-        k = tbl->array[2*j  ];
-        v = tbl->array[2*j+1];
+                if (l >= tbl->count)
+                    return false;
 
-        j += 1;
-    } while (isnil(k) || isnil(v));
+                if (o < tbl->leaves[l]->len) {
+                    *k = tbl->leaves[l]->array[2*o  ];
+                    *v = tbl->leaves[l]->array[2*o+1];
+                    it->j += 1;
+                    break;
+                }
 
-    tbl_insert(ret, vnum(0), v, eh);
-    tbl_insert(ret, vnum(1), k, eh);
-    tbl_insert(ret, vnum(2), vnum(i), eh);
+                it->j = (l+1) << MU_LEAFBITS;
+            }
+            break;
 
-    i += 1;
-    tbl_insert(scope, vnum(2), vraw(i), eh);
-    tbl_insert(scope, vnum(3), vraw(j), eh);
+        case TBL_HAMT: {
+            var_t *e = hamt_nth(tbl->root, it->i);
+            *k = e[0];
+            *v = e[1];
+            break;
+        }
+    }
 
-    return vtbl(ret);
+    it->i += 1;
+    return true;
 }
 
-var_t tbl_iter(var_t v, eh_t *eh) {
-    static sfn_t * const tbl_iters[3] = {
-        tbl_0_iteration,
-        tbl_1_iteration,
-        tbl_2_iteration
-    };
 
-    tbl_t *tbl = tbl_read(gettbl(v));
-    tbl_t *scope = tbl_create(3, eh);
-    tbl_insert(scope, vnum(0), vtbl(tbl), eh);
-    tbl_insert(scope, vnum(1), vtbl(tbl_create(3, eh)), eh);
-    tbl_insert(scope, vnum(2), vraw(0), eh);
+// Returns a string representation of the table
+var_t tbl_repr(var_t v, eh_t *eh) {
+    strb_t b;
+    strb_init(&b, 0, eh);
+    tbl_reprb(v, &b, eh);
 
-    return vsfn(tbl_iters[tbl->stride], scope);
+    return strb_finish(&b, eh);
 }
 
-
-// Returns a string representation of the table
-var_t tbl_repr(var_t v, eh_t *eh) {
+// Writes a string representation of the table into a builder
+// nested tables are written directly into the same builder
+void tbl_reprb(var_t v, strb_t *b, eh_t *eh) {
     tbl_t *tbl = gettbl(v);
-    var_t *reprs = mu_alloc(2*tbl_len(tbl) * sizeof(var_t), eh);
+    bool first = true;
 
-    int size = 2;
-    int i = 0;
+    strb_append(b, vcstr("["), eh);
 
     tbl_for_begin (k, v, tbl) {
-        reprs[2*i  ] = var_repr(k, eh);
-        reprs[2*i+1] = var_repr(v, eh);
-        size += getlen(reprs[2*i  ]);
-        size += getlen(reprs[2*i+1]);
-        size += (i == tbl_len(tbl)-1) ? 2 : 4;
-
-        i++;
-    } tbl_for_end;
-
-    if (size > MU_MAXLEN)
-        err_len(eh);
-
-    mstr_t *out = str_create(size, eh);
-    mstr_t *res = out;
+        if (!first)
+            strb_append(b, vcstr(", "), eh);
 
-    *res++ = '[';
+        var_reprb(k, b, eh);
+        strb_append(b, vcstr(": "), eh);
+        var_reprb(v, b, eh);
 
-    for (i=0; i < tbl_len(tbl); i++) {
-        memcpy(res, getstr(reprs[2*i]), getlen(reprs[2*i]));
-        res += getlen(reprs[2*i]);
-        var_dec(reprs[2*i]);
-
-        *res++ = ':';
-        *res++ = ' ';
-
-        memcpy(res, getstr(reprs[2*i+1]), getlen(reprs[2*i+1]));
-        res += getlen(reprs[2*i+1]);
-        var_dec(reprs[2*i+1]);
-
-        if (i != tbl_len(tbl)-1) {
-            *res++ = ',';
-            *res++ = ' ';
-        }
-    }
-
-    *res++ = ']';
-
-    mu_dealloc(reprs, 2*tbl_len(tbl) * sizeof(var_t));
+        first = false;
+    } tbl_for_end;
 
-    return vstr(out, 0, size);
+    strb_append(b, vcstr("]"), eh);
 }
@@ -13,9 +13,34 @@
 // Lowest bit in table pointer indicates readonly if set
 #define MU_TBLRO 0x1
 
+// Number of var slots stored inline in each table, enough for
+// hashed tables of up to four entries, which are scanned rather
+// than probed. This gives up fitting a table in one cache line
+// so the most common small tables avoid a second allocation.
+#define MU_TBLSLOTS 8
+
+// Number of keys hashed and prefetched together by tbl_lookup_many
+#define MU_TBLBATCH 16
+
+// Entries in each leaf of a sorted table as a power of two
+#define MU_LEAFBITS 6
+#define MU_LEAFLEN (1 << MU_LEAFBITS)
+
 
 typedef struct tbl tbl_t;
 
+struct leaf;
+struct hnode;
+
+
+// Iteration state for tables, kept directly by the
+// iterating code so stepping requires no allocations
+typedef struct iter {
+    struct tbl *tbl;    // table being iterated
+    tlen_t i;           // index of next entry
+    hash_t j;           // next slot in the array or leaves
+} iter_t;
+
 
 #endif
 #else
@@ -27,45 +52,113 @@ typedef struct tbl tbl_t;
 
 #include "mem.h"
 #include "err.h"
+#include "gc.h"
 
 
 // Each table is composed of an array of values 
 // with a stride for keys/values. If keys/values 
 // is not stored in the array it is implicitely 
 // stored as a range/offset based on the specified 
-// offset and length.
+// offset, step, and length. Slices are stored as a
+// view into a base table until they are written to.
+// Lists containing only numbers are stored as packed
+// nums until another type of value is stored. Entries
+// of small tables are stored in slots inline with the
+// table, avoiding a separate allocation. Sorted tables
+// keep their entries ordered in an array of leaves, and
+// persistent tables share an immutable trie of entries.
 struct tbl {
     struct tbl *tail; // tail chain of tables
 
-    len_t nils;     // count of nil entries
-    len_t len;      // count of keys in use
+    tlen_t nils;    // count of nil entries
+    tlen_t len;     // count of keys in use
     hash_t mask;    // size of entries - 1
 
     enum { 
         TBL_RANGE = 0, 
-        TBL_LIST  = 1, 
-        TBL_HASH  = 2 
-    } stride;           // table types
+        TBL_SLICE = 1,
+        TBL_NUMS  = 2,
+        TBL_LIST  = 3, 
+        TBL_HASH  = 4,
+        TBL_TREE  = 5,
+        TBL_HAMT  = 6
+    } stride : 8;       // table types
+    bool tailed : 1;    // used as a tail, keeps a filter of keys
 
     union {
-        int offset;    // offset for implicit ranges
-        var_t *array;  // pointer to stored data
+        struct {
+            int offset;         // offset for ranges and slices
+            int step;           // step for ranges and slices
+            struct tbl *base;   // table viewed by slices
+        };
+
+        struct {
+            struct leaf **leaves;   // ordered leaves of entries
+            hash_t count;           // count of leaves in use
+        };
+
+        struct hnode *root;     // trie of persistent tables
+
+        num_t *nums;   // pointer to packed nums
+
+        struct {
+            var_t *array;   // pointer to stored data
+            uint64_t bloom; // filter of key hashes in tailed tables
+        };
     };
+
+    var_t slots[MU_TBLSLOTS]; // inline storage for small tables
 };
 
 
 // Functions for managing tables
 // Each table is preceeded with a reference count
 // which is used as its handle in a var
-tbl_t *tbl_create(len_t size, eh_t *eh);
+tbl_t *tbl_create(tlen_t size, eh_t *eh);
+
+// Creates a table containing the implicit range
+// offset, offset+step, ... without storing any entries
+tbl_t *tbl_range(int offset, int step, tlen_t len, eh_t *eh);
+
+// Creates a view of entries offset, offset+step, ... in a
+// table, entries are only copied once the slice is written
+// Changes to the base table are visible through the slice
+// whatever the base's representation
+tbl_t *tbl_slice(tbl_t *base, int offset, int step, tlen_t len, eh_t *eh);
+
+// Creates a table which keeps its keys in sorted order
+// as defined by var_compare, iterating in that order
+tbl_t *tbl_sorted(eh_t *eh);
+
+// Creates a persistent table holding the entries of a
+// table, persistent tables can not be modified in place
+tbl_t *tbl_persist(tbl_t *, eh_t *eh);
+
+// Returns a persistent table with the key set to the value,
+// or removed if the value is nil, sharing unchanged entries
+tbl_t *tbl_with(tbl_t *, var_t key, var_t val, eh_t *eh);
+
+// Sets the tail of a table, tables used as tails keep a
+// filter of their keys so lookups through them are cheaper
+void tbl_settail(tbl_t *, tbl_t *tail);
 
 // Called by garbage collector to clean up
 void tbl_destroy(void *);
 
+// Called by the cycle collector to visit the references
+// held by a table and to release them, emptying the table
+void tbl_visit(var_t v, void (*visit)(var_t));
+void tbl_clear(var_t v);
+
 // Recursively looks up a key in the table
 // returns either that value or nil
 var_t tbl_lookup(tbl_t *, var_t key);
 
+// Looks up many keys at once, storing each value or nil
+// Keys are hashed and their slots prefetched in batches
+// so the cache misses of each probe overlap
+void tbl_lookup_many(tbl_t *, const var_t *keys, var_t *vals, tlen_t n);
+
 // Recursively looks up either a key or index
 // if key is not found
 var_t tbl_lookdn(tbl_t *, var_t key, len_t i);
@@ -81,59 +174,68 @@ void tbl_insert(tbl_t *, var_t key, var_t val, eh_t *eh);
 // Sets the next index in the table with the value
 void tbl_append(tbl_t *, var_t val, eh_t *eh);
 
+// Returns a list with the numbers of a list stored as packed
+// nums, which is the list itself if it is already packed. Other
+// lists are copied rather than converted, so the numeric builtins
+// never change the representation of their arguments, and slices
+// stay views. Errors on tables holding anything but numbers
+tbl_t *tbl_packed(tbl_t *, eh_t *eh);
+
+// Returns a new list with the numbers of a list as packed nums
+tbl_t *tbl_packcopy(tbl_t *, eh_t *eh);
+
+// Returns the smallest key not less than the given key
+// or nil if there is none
+var_t tbl_lower(tbl_t *, var_t key);
+
+// Returns a sorted table of the entries with keys in
+// the range [lo, hi), sorted tables take O(log n + k)
+tbl_t *tbl_between(tbl_t *, var_t lo, var_t hi, eh_t *eh);
+
 
 // Performs iteration on a table
-var_t tbl_iter(var_t v, eh_t *eh);
+void tbl_iter(var_t v, iter_t *it, eh_t *eh);
+
+// Steps an iterator, storing the next key and value
+// returns false once the table has been exhausted
+bool tbl_iter_next(iter_t *it, var_t *k, var_t *v);
 
 // Returns a string representation of the table
 var_t tbl_repr(var_t v, eh_t *eh);
 
+// Writes a string representation of the table into a builder
+void tbl_reprb(var_t v, strb_t *b, eh_t *eh);
+
 
 // Macro for iterating through a table in c
 // Assign names for k and v, and pass in the 
 // block to execute for each pair in tbl
 #define tbl_for_begin(k, v, tbl) {                  \
+    iter_t _it;                                     \
+    tbl_iter(vtbl(tbl), &_it, 0);                   \
+                                                    \
     var_t k;                                        \
     var_t v;                                        \
-    tbl_t *_t = tbl_read(tbl);                      \
-    int _i, _c = _t->len;                           \
                                                     \
-    for (_i=0; _c; _i++) {                          \
-        switch (_t->stride) {                       \
-            case 0:                                 \
-                k = vnum(_i);                       \
-                v = vnum(_t->offset + _i);          \
-                break;                              \
-            case 1:                                 \
-                k = vnum(_i);                       \
-                v = _t->array[_i];                  \
-                break;                              \
-            case 2:                                 \
-                k = _t->array[2*_i  ];              \
-                v = _t->array[2*_i+1];              \
-                if (isnil(k) || isnil(v))           \
-                    continue;                       \
-                break;                              \
-        }                                           \
+    while (tbl_iter_next(&_it, &k, &v)) {           \
 {
 #define tbl_for_end                                 \
 }                                                   \
-        _c--;                                       \
     }                                               \
 }
 
 
 // Accessing table pointers with the ro flag
 mu_inline bool tbl_isro(tbl_t *tbl) {
-    return MU_TBLRO & (uint32_t)tbl;
+    return MU_TBLRO & (uintptr_t)tbl;
 }
 
 mu_inline tbl_t *tbl_ro(tbl_t *tbl) {
-    return (tbl_t *)(MU_TBLRO | (uint32_t)tbl);
+    return (tbl_t *)(MU_TBLRO | (uintptr_t)tbl);
 }
 
 mu_inline tbl_t *tbl_read(tbl_t *tbl) {
-    return (tbl_t *)(~MU_TBLRO & (uint32_t)tbl);
+    return (tbl_t *)(~MU_TBLRO & (uintptr_t)tbl);
 }
 
 mu_inline tbl_t *tbl_write(tbl_t *tbl, eh_t *eh) {
@@ -144,11 +246,14 @@ mu_inline tbl_t *tbl_write(tbl_t *tbl, eh_t *eh) {
 }
 
 // Accessing table properties
-mu_inline len_t tbl_len(tbl_t *tbl) { return tbl_read(tbl)->len; }
+mu_inline tlen_t tbl_len(tbl_t *tbl) { return tbl_read(tbl)->len; }
+
+// Packed nums of a list returned by tbl_packed
+mu_inline num_t *tbl_nums(tbl_t *tbl) { return tbl_read(tbl)->nums; }
 
 // Table reference counting
 mu_inline void tbl_inc(void *m) { ref_inc(m); }
-mu_inline void tbl_dec(void *m) { ref_dec(m, tbl_destroy); }
+mu_inline void tbl_dec(void *m) { gc_dec(m, MU_TBL, tbl_destroy); }
 
 
 #endif
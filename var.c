@@ -17,8 +17,8 @@ static bool bit_equals(var_t a, var_t b) { return a.bits == b.bits; }
 
 bool var_equals(var_t a, var_t b) {
     static bool (* const var_equalss[8])(var_t, var_t) = {
-        nil_equals, num_equals, bit_equals, bit_equals,
-        bit_equals, bit_equals, str_equals, bit_equals
+        nil_equals, num_equals, bit_equals, fn_equals,
+        bit_equals, bit_equals, str_equals, fn_equals
     };
 
     if (type(a) != type(b))
@@ -31,28 +31,70 @@ bool var_equals(var_t a, var_t b) {
 // Returns a hash value of the given variable. 
 // nils should never be hashed
 // use raw bits by default
-static hash_t bit_hash(var_t v) { return v.meta ^ v.data; }
+static hash_t bit_hash(var_t v) { return v.bits ^ (v.bits >> 32); }
 
 hash_t var_hash(var_t v) {
     static hash_t (* const var_hashs[8])(var_t) = {
-        bit_hash, num_hash, bit_hash, bit_hash,
-        bit_hash, bit_hash, str_hash, bit_hash
+        bit_hash, num_hash, bit_hash, fn_hash,
+        bit_hash, bit_hash, str_hash, fn_hash
     };
 
     return var_hashs[type(v)](v);
 }
 
 
+// Returns the ordering of two variables of the same type
+// compare raw bits by default
+static int nil_compare(var_t a, var_t b) { return 0; }
+static int bit_compare(var_t a, var_t b) { return (a.bits > b.bits) - (a.bits < b.bits); }
+
+int var_compare(var_t a, var_t b) {
+    static int (* const var_compares[8])(var_t, var_t) = {
+        nil_compare, num_compare, bit_compare, fn_compare,
+        bit_compare, bit_compare, str_compare, fn_compare
+    };
+
+    if (type(a) != type(b))
+        return type(a) < type(b) ? -1 : 1;
+
+    return var_compares[type(a)](a, b);
+}
+
+
 // Performs iteration on variables
-static var_t nil_iter(var_t v, eh_t *eh) { err_undefined(eh); }
+static void nil_iter(var_t v, iter_t *it, eh_t *eh) { err_undefined(eh); }
 
-var_t var_iter(var_t v, eh_t *eh) {
-    static var_t (* const var_iters[8])(var_t, eh_t *) = {
+void var_iter(var_t v, iter_t *it, eh_t *eh) {
+    static void (* const var_iters[8])(var_t, iter_t *, eh_t *) = {
         nil_iter, nil_iter, nil_iter, nil_iter,
         tbl_iter, nil_iter, nil_iter, nil_iter
     };
 
-    return var_iters[type(v)](v, eh);
+    var_iters[type(v)](v, it, eh);
+}
+
+
+// Visits and releases references held by variables
+// for the cycle collector
+static void nil_visit(var_t v, void (*visit)(var_t)) {}
+static void nil_clear(var_t v) {}
+
+void var_visit(var_t v, void (*visit)(var_t)) {
+    static void (* const var_visits[8])(var_t, void (*)(var_t)) = {
+        nil_visit, nil_visit, nil_visit, cls_visit,
+        tbl_visit, tbl_visit, nil_visit, cls_visit
+    };
+
+    var_visits[type(v)](v, visit);
+}
+
+void var_clear(var_t v) {
+    static void (* const var_clears[8])(var_t) = {
+        nil_clear, nil_clear, nil_clear, cls_clear,
+        tbl_clear, tbl_clear, nil_clear, cls_clear
+    };
+
+    var_clears[type(v)](v);
 }
     
 
@@ -70,6 +112,24 @@ var_t var_repr(var_t v, eh_t *eh) {
 }
 
 
+// Writes a string representation of the variable into a builder
+// tables and numbers write directly, other types append their repr
+static void var_reprs(var_t v, strb_t *b, eh_t *eh) {
+    var_t repr = var_repr(v, eh);
+    strb_append(b, repr, eh);
+    var_dec(repr);
+}
+
+void var_reprb(var_t v, strb_t *b, eh_t *eh) {
+    static void (* const var_reprbs[8])(var_t, strb_t *, eh_t *) = {
+        var_reprs, num_reprb, var_reprs, var_reprs,
+        tbl_reprb, var_reprs, var_reprs, var_reprs
+    };
+
+    var_reprbs[type(v)](v, b, eh);
+}
+
+
 // Table related functions performed on variables
 static var_t nil_lookup(var_t t, var_t k, eh_t *eh)  { err_undefined(eh); }
 static var_t vtbl_lookup(var_t t, var_t k, eh_t *eh) { return tbl_lookup(gettbl(t), k); }
@@ -137,9 +197,9 @@ void var_append(var_t v, var_t val, eh_t *eh) {
 
 // Function calls performed on variables
 static var_t nil_call(var_t f, tbl_t *a, eh_t *eh)  { err_undefined(eh); }
-static var_t vfn_call(var_t f, tbl_t *a, eh_t *eh)  { return fn_call(getfn(f), a, gettbl(f), eh); }
+static var_t vfn_call(var_t f, tbl_t *a, eh_t *eh)  { return fn_call(getfn(f), a, getscope(f), eh); }
 static var_t vbfn_call(var_t f, tbl_t *a, eh_t *eh) { return getbfn(f)(a, eh); }
-static var_t vsfn_call(var_t f, tbl_t *a, eh_t *eh) { return getsfn(f)(a, gettbl(f), eh); }
+static var_t vsfn_call(var_t f, tbl_t *a, eh_t *eh) { return getsfn(f)(a, getscope(f), eh); }
 
 var_t var_call(var_t v, tbl_t *args, eh_t *eh) {
     static var_t (* const var_calls[8])(var_t, tbl_t *, eh_t *) = {
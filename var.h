@@ -20,10 +20,30 @@ typedef uint16_t len_t;
 
 #define MU_MAXLEN UINT16_MAX
 
+// Length of tables, which may hold far more entries
+// than other structures. The limit keeps both the byte size
+// of a table's storage and twice its hashed capacity
+// representable in a size_t and hash_t after growth.
+typedef uint32_t tlen_t;
+
+#define MU_MAXTLEN (SIZE_MAX / (8*sizeof(var_t)) < UINT32_MAX / 6 ? \
+                    SIZE_MAX / (8*sizeof(var_t)) : UINT32_MAX / 6)
+
+// Length of strings, strings too long for their length field
+// store their length before the reference count and mark the
+// length field with MU_BIGSTR
+typedef uint32_t slen_t;
+
+#define MU_MAXSLEN INT32_MAX
+#define MU_BIGSTR UINT16_MAX
+
+// Strings short enough to fit in a var are stored inline
+#define MU_STRINLINE 5
+
 
 // Three bit type specifier located in lowest bits of each var
 // 3b1xx indicates reference counted
-// 3bx11 indicates additional table attached
+// 3bx11 indicates a scope attached through a counted closure
 enum type {
     MU_NIL = 0, // nil
     MU_NUM = 1, // number
@@ -36,6 +56,25 @@ enum type {
 };
 
 
+// Vars are 64 bit values which NaN-box numbers. Doubles are offset
+// by MU_NUMOFF, leaving values below it for 47 bit pointers tagged
+// with their type, and values above MU_INTTAG for 32 bit integers.
+// Nil is all zeros, so zeroed memory holds nils.
+//
+// pointers  0x0000 | ro | 47 bit pointer with type in low bits
+// inline    0x0001 | 5 bytes | 00 | 3 bit len | type
+// doubles   double + MU_NUMOFF
+// integers  0xfffe | 0x0000 | int32
+#define MU_NUMOFF ((uint64_t)1 << 49)
+#define MU_INTTAG ((uint64_t)0xfffe << 48)
+
+// Pointers fit in the lower 47 bits, leaving bit 47 to mark
+// readonly tables and bit 48 to mark inline strings
+#define MU_PTRMASK (((uint64_t)1 << 47) - 1)
+#define MU_VARRO   ((uint64_t)1 << 47)
+#define MU_VARISTR ((uint64_t)1 << 48)
+
+
 // declaration of var type
 typedef struct var {
     union {
@@ -43,40 +82,7 @@ typedef struct var {
         uint64_t bits;
         uint8_t  bytes[8];
 
-        struct {
-            union {
-                // metadata for all vars
-                uint32_t meta;
-
-                // type specifier is encoded in lower 3 bits
-                enum type type : 3;
-
-                // reference counting is performed here for half of vars
-                ref_t *ref;
-
-                // string encoding
-                str_t *str;
-
-                // function encoding
-                struct fn *fn;
-            };
-
-            union {
-                // data for vars
-                uint32_t data;
-
-                // string offset and length
-                struct {
-                    len_t len;
-                    len_t off;
-                };
-
-                // table encoding
-                struct tbl *tbl;
-            };
-        };
-
-        // number encoding
+        // number encoding, offset by MU_NUMOFF
         num_t num;
     };
 } var_t;
@@ -94,36 +100,82 @@ typedef struct var {
 #undef MU_DEF
 
 #include "mem.h"
+#include "gc.h"
+#include <math.h>
 
 
 // definitions for accessing components
-mu_inline enum type type(var_t v)  { return v.type; }
-
-mu_inline void *getptr(var_t v)    { return v.ref; }
-mu_inline uint32_t getraw(var_t v) { return v.data; }
-mu_inline ref_t *getref(var_t v)   { return (ref_t *)(v.meta & ~7); }
-mu_inline num_t getnum(var_t v)    { v.meta &= ~7; return v.num; }
-mu_inline str_t *getstart(var_t v) { return v.str; }
-mu_inline str_t *getstr(var_t v)   { return v.str + v.off; }
-mu_inline str_t *getend(var_t v)   { return v.str + v.off + v.len; }
-mu_inline len_t getoff(var_t v)    { return v.off; }
-mu_inline len_t getlen(var_t v)    { return v.len; }
-mu_inline tbl_t *gettbl(var_t v)   { return v.tbl; }
-mu_inline fn_t *getfn(var_t v)     { return (fn_t *)(v.meta & ~3); }
-mu_inline bfn_t *getbfn(var_t v)   { return (bfn_t *)getfn(v); }
-mu_inline sfn_t *getsfn(var_t v)   { return (sfn_t *)getfn(v); }
+mu_inline enum type type(var_t v) {
+    return v.bits < MU_NUMOFF ? (enum type)(7 & v.bits) : MU_NUM;
+}
+
+mu_inline void *getptr(var_t v)    { return (void *)(uintptr_t)(MU_PTRMASK & v.bits); }
+mu_inline ref_t *getref(var_t v)   { return ref_get(getptr(v)); }
+mu_inline uint32_t getraw(var_t v) { return (uint32_t)v.bits; }
+mu_inline int32_t getint(var_t v)  { return (int32_t)v.bits; }
+mu_inline bfn_t *getbfn(var_t v)   { return (bfn_t *)(~7 & (uintptr_t)getptr(v)); }
+mu_inline cls_t *getcls(var_t v)   { return (cls_t *)(getref(v) + 1); }
+mu_inline fn_t *getfn(var_t v)     { return getcls(v)->fn; }
+mu_inline sfn_t *getsfn(var_t v)   { return getcls(v)->sfn; }
+mu_inline tbl_t *getscope(var_t v) { return getcls(v)->scope; }
+
+// tables are counted from the reference, so the readonly
+// flag is carried separately from the pointer
+mu_inline tbl_t *gettbl(var_t v) {
+    return (tbl_t *)((uintptr_t)(getref(v) + 1) |
+                     ((MU_VARRO & v.bits) ? MU_TBLRO : 0));
+}
+
+// non-numbers read as zero
+mu_inline num_t getnum(var_t v) {
+    if (v.bits >= MU_INTTAG)
+        return getint(v);
+    else if (v.bits < MU_NUMOFF)
+        return 0;
+
+    v.bits -= MU_NUMOFF;
+    return v.num;
+}
 
 
 // properties of variables
-mu_inline bool isnil(var_t v) { return !v.meta; }
-mu_inline bool isnum(var_t v) { return type(v) == MU_NUM; }
+mu_inline bool isnil(var_t v) { return !v.bits; }
+mu_inline bool isnum(var_t v) { return v.bits >= MU_NUMOFF; }
+mu_inline bool isint(var_t v) { return v.bits >= MU_INTTAG; }
 mu_inline bool isstr(var_t v) { return type(v) == MU_STR; }
-mu_inline bool istbl(var_t v) { return (6 & v.meta) == 4; }
+mu_inline bool istbl(var_t v) { return v.bits < MU_NUMOFF && (6 & v.bits) == 4; }
 mu_inline bool isobj(var_t v) { return type(v) == MU_OBJ; }
-mu_inline bool isfn(var_t v)  { return (6 & v.meta) == 2 || type(v) == MU_FN; }
+mu_inline bool isfn(var_t v)  { return v.bits < MU_NUMOFF &&
+                                       ((6 & v.bits) == 2 || (7 & v.bits) == 7); }
+mu_inline bool isistr(var_t v) { return (v.bits >> 48) == 1; }
+
+mu_inline bool hasref(var_t v)   { return (v.bits >> 48) == 0 && (7 & v.bits) >= 3; }
+mu_inline bool hasscope(var_t v) { return (v.bits >> 48) == 0 && (3 & v.bits) == 3; }
+
 
-mu_inline bool hasref(var_t v)   { return 4 & v.meta; }
-mu_inline bool hasscope(var_t v) { return !(3 & ~v.meta); }
+// Strings are always whole, inline strings keep their bytes
+// in the var itself so are accessed through the var's address
+// Other strings keep their length in the header before the
+// reference count
+mu_inline slen_t getlen(var_t v) {
+    if (mu_unlikely(isistr(v)))
+        return 7 & (v.bits >> 3);
+
+    const len_t *len = (const len_t *)getref(v) - 1;
+
+    if (mu_unlikely(*len == MU_BIGSTR))
+        return ((const slen_t *)getref(v))[-2];
+
+    return *len;
+}
+
+mu_inline str_t *getstr(const var_t *v) {
+    return isistr(*v) ? &v->bytes[1] : (str_t *)(getref(*v) + 1);
+}
+
+mu_inline str_t *getend(const var_t *v) {
+    return getstr(v) + getlen(*v);
+}
 
 
 // definitions of literal vars in C
@@ -133,100 +185,118 @@ mu_inline bool hasscope(var_t v) { return !(3 & ~v.meta); }
 #define vninf vnum(-INFINITY)
 
 // var constructors for C
-mu_inline var_t vraw(uint32_t raw) {
+mu_inline var_t vptr(const void *ptr, enum type type) {
+    mu_assert((uintptr_t)ptr <= MU_PTRMASK);
+
     var_t v;
-    v.data = raw;
-    v.type = MU_NUM;
+    v.bits = ((uintptr_t)ptr & ~7) | type;
     return v;
 }
 
-mu_inline var_t vnum(num_t num) {
+mu_inline var_t vint(int32_t i) {
     var_t v;
-    v.num = num;
-    v.type = MU_NUM;
+    v.bits = MU_INTTAG | (uint32_t)i;
     return v;
 }
 
-mu_inline var_t vstr(str_t *str, len_t off, len_t len) {
+mu_inline var_t vraw(uint32_t raw) {
+    return vint((int32_t)raw);
+}
+
+// Numbers are kept canonical, so any number that fits in a 32 bit
+// integer is stored as one, with the exception of negative zero,
+// and all nans are stored as the same nan
+mu_inline var_t vnum(num_t num) {
+    if (num >= INT32_MIN && num <= INT32_MAX &&
+        (int32_t)num == num && (num != 0 || !signbit(num)))
+        return vint((int32_t)num);
+
     var_t v;
-    v.str = str;
-    v.off = off;
-    v.len = len;
-    v.type = MU_STR;
+    v.num = num == num ? num : NAN;
+    v.bits += MU_NUMOFF;
     return v;
 }
 
+mu_inline var_t vstr(str_t *str) {
+    return vptr(str, MU_STR);
+}
+
 mu_inline var_t vtbl(tbl_t *tbl) {
-    var_t v;
-    v.ref = (ref_t*)tbl;
-    v.tbl = tbl;
-    v.type = MU_TBL;
+    var_t v = vptr((void *)((uintptr_t)tbl & ~MU_TBLRO), MU_TBL);
+    v.bits |= (MU_TBLRO & (uintptr_t)tbl) ? MU_VARRO : 0;
     return v;
 }
 
 mu_inline var_t vobj(tbl_t *tbl) {
-    var_t v;
-    v.ref = (ref_t*)tbl;
-    v.tbl = tbl;
-    v.type = MU_OBJ;
+    var_t v = vptr((void *)((uintptr_t)tbl & ~MU_TBLRO), MU_OBJ);
+    v.bits |= (MU_TBLRO & (uintptr_t)tbl) ? MU_VARRO : 0;
     return v;
 }
 
-mu_inline var_t vfn(fn_t *fn, tbl_t *scope) {
-    var_t v;
-    v.fn = fn;
-    v.tbl = scope;
-    v.type = MU_FN;
-    return v;
+mu_inline var_t vbfn(bfn_t *bfn) {
+    return vptr((void *)bfn, MU_BFN);
 }
 
-mu_inline var_t vbfn(bfn_t *bfn) {
-    var_t v;
-    v.fn = (fn_t *)bfn;
-    v.type = MU_BFN;
-    return v;
+// Functions with scopes are referenced through closures
+mu_inline var_t vfn(cls_t *cls) {
+    return vptr(cls, MU_FN);
 }
 
-mu_inline var_t vsfn(sfn_t *sfn, tbl_t *scope) {
+mu_inline var_t vsfn(cls_t *cls) {
+    return vptr(cls, MU_SFN);
+}
+
+mu_inline var_t vistr(str_t *str, len_t len) {
+    mu_assert(len <= MU_STRINLINE);
+
     var_t v;
-    v.fn = (fn_t *)sfn;
-    v.tbl = scope;
-    v.type = MU_SFN;
+    len_t i;
+    v.bits = MU_VARISTR | (len << 3) | MU_STR;
+
+    for (i = 0; i < len; i++)
+        v.bytes[1+i] = str[i];
+
     return v;
 }
 
 #define vcstr(c) ({                         \
-    static const struct {                   \
-        ref_t r;                            \
+    static const struct mu_aligned {        \
+        len_t p;                            \
         len_t l;                            \
+        ref_t r;                            \
         str_t s[sizeof(c)-1];               \
-    } _vcstr = { 0, sizeof(c)-1, {(c)}};    \
+        strt_t t;                           \
+    } _vcstr = { 0, sizeof(c)-1, 0, {(c)}}; \
                                             \
-    vstr(_vcstr.s, 0, sizeof(c)-1);         \
+    vstr(_vcstr.s);                         \
 })
 
 
 // Mapping of reference counting functions
 extern void tbl_destroy(void *);
 extern void str_destroy(void *);
-extern void fn_destroy(void *);
+extern void cls_destroy(void *);
+extern void scls_destroy(void *);
 
 mu_inline void var_inc(var_t v) {
     if (hasref(v))
         ref_inc(getptr(v));
-    if (hasscope(v))
-        ref_inc(gettbl(v));
 }
 
 mu_inline void var_dec(var_t v) {
-    static void (* const dtors[4])(void *) = {
-        tbl_destroy, 0, str_destroy, fn_destroy
+    static void (* const dtors[8])(void *) = {
+        0, 0, 0, scls_destroy,
+        tbl_destroy, tbl_destroy, str_destroy, cls_destroy
     };
 
-    if (hasref(v))
-        ref_dec(getptr(v), dtors[3 & v.meta]);
-    if (hasscope(v))
-        ref_dec(gettbl(v), tbl_destroy);
+    // strings can't form cycles, anything else is left
+    // to the cycle collector when it survives a decrement
+    if (hasref(v)) {
+        if (type(v) == MU_STR)
+            ref_dec(getptr(v), str_destroy);
+        else
+            gc_dec(getptr(v), type(v), dtors[7 & v.bits]);
+    }
 }
 
 
@@ -237,8 +307,21 @@ bool var_equals(var_t a, var_t b);
 // Returns a hash value of the given variable. 
 hash_t var_hash(var_t var);
 
+// Returns the ordering of two variables as negative, zero,
+// or positive. Variables are ordered first by type.
+int var_compare(var_t a, var_t b);
+
 // Performs iteration on variables
-var_t var_iter(var_t v, eh_t *eh);
+void var_iter(var_t v, iter_t *it, eh_t *eh);
+
+// Visits the counted references held by a table or closure,
+// and releases them leaving the variable empty, for the
+// cycle collector
+void var_visit(var_t v, void (*visit)(var_t));
+void var_clear(var_t v);
+
+// Writes a string representation of the variable into a builder
+void var_reprb(var_t v, strb_t *b, eh_t *eh);
 
 // Returns a string representation of the variable
 var_t var_repr(var_t v, eh_t *eh);
@@ -4,6 +4,7 @@
 #include "var.h"
 #include "fn.h"
 #include "tbl.h"
+#include "gc.h"
 
 
 // bytecode does not need to be portable, as it 
@@ -14,17 +15,84 @@ mu_inline arg_t arg(const str_t *pc) {
 }
 
 mu_inline sarg_t sarg(const str_t *pc) {
-    return (signed)arg(pc);
+    return (sarg_t)(((arg_t)pc[0] << 24) | ((arg_t)pc[1] << 16) |
+                    ((arg_t)pc[2] << 8) | pc[3]);
+}
+
+mu_inline bool isjump(op_t op) {
+    switch (op >> 3) {
+        case OP_JUMP:
+        case OP_JFALSE:
+        case OP_JTRUE:
+        case OP_NEXT:   return true;
+        default:        return false;
+    }
+}
+
+// iterator state is stored directly in stack slots, the table
+// followed by its two counters, so stepping through a table
+// never allocates and every slot holds a valid var
+mu_inline bool next(var_t *sp) {
+    iter_t it = {tbl_read(gettbl(sp[2])), getraw(sp[1]), getraw(sp[0])};
+
+    // ranges run as plain counted loops with the
+    // induction variable kept in the iterator slot
+    if (it.tbl->stride == TBL_RANGE) {
+        if (it.i >= it.tbl->len)
+            return false;
+
+        sp[-1] = vnum(it.tbl->offset + (num_t)it.i*it.tbl->step);
+        sp[-2] = vnum(it.i);
+        sp[-3] = sp[-2];
+        sp[1] = vraw(it.i + 1);
+        return true;
+    }
+
+    if (!tbl_iter_next(&it, &sp[-2], &sp[-1]))
+        return false;
+
+    var_inc(sp[-2]);
+    var_inc(sp[-1]);
+    sp[-3] = vnum(it.i - 1);
+    sp[1] = vraw(it.i);
+    sp[0] = vraw(it.j);
+    return true;
+}
+
+// starts iterating over the table in s0
+mu_inline void iter(var_t *sp, eh_t *eh) {
+    iter_t it;
+    var_iter(sp[0], &it, eh);
+
+    sp[-1] = vraw(it.i);
+    sp[-2] = vraw(it.j);
+}
+
+// values looked up are counted before releasing
+// the table, which may be the only thing keeping them
+mu_inline var_t lookup(var_t *sp, var_t v) {
+    var_inc(v);
+    var_dec(sp[0]);
+    var_dec(sp[1]);
+    return v;
+}
+
+// releases anything left on the stack when returning
+mu_inline void release(var_t *sp, var_t *end) {
+    while (sp < end)
+        var_dec(*sp++);
 }
 
 // Return the size taken by the specified opcode
 // Note: size of the jump opcode currently can not change
 // based on argument, because this is not handled by the parser
 int mu_size(op_t op, arg_t arg) {
-    if (MU_ARG & op)
-        return 3;
-    else
+    if (!(MU_ARG & op))
         return 1;
+    else if (isjump(op))
+        return 5;
+    else
+        return 3;
 }
 
 // Encode the specified opcode and return its size
@@ -32,47 +100,157 @@ void mu_encode(mstr_t *code, op_t op, arg_t arg) {
     *code++ = op;
 
     if (MU_ARG & op) {
-        *code++ = arg >> 8;
+        if (isjump(op)) {
+            *code++ = arg >> 24;
+            *code++ = 0xff & (arg >> 16);
+        }
+
+        *code++ = 0xff & (arg >> 8);
         *code++ = 0xff & arg;
     }
 }
 
+// Return the stack slots needed to execute the bytecode
+// Every path through the code is followed from the start,
+// which reaches each instruction with the same depth
+len_t mu_stack(const str_t *code, tlen_t len, eh_t *eh) {
+    int *depths = mu_alloc(2*len * sizeof(int), eh);
+    int *pending = depths + len;
+    int count = 0;
+    int max = 1; // a variable length array can't be empty
+    int i;
+
+    for (i = 0; i < len; i++)
+        depths[i] = -1;
+
+    depths[0] = 0;
+    pending[count++] = 0;
+
+    while (count > 0) {
+        const str_t *pc = &code[pending[--count]];
+        int depth = depths[pc - code];
+        int jump = -1;
+        int next = -1;
+        op_t op = *pc++ >> 3;
+
+        switch (op) {
+            case OP_VAR:
+            case OP_FN:
+            case OP_NIL:
+            case OP_TBL:
+            case OP_SCOPE:
+            case OP_ARGS:
+            case OP_DUP:    depth += 1;                                         break;
+
+            case OP_DROP:
+            case OP_LOOKUP:
+            case OP_LOOKDN:
+            case OP_APPEND:
+            case OP_CALL:   depth -= 1;                                         break;
+
+            case OP_ASSIGN: depth -= 3;                                         break;
+            case OP_INSERT: depth -= 2;                                         break;
+            case OP_ITER:   depth += 2;                                         break;
+
+            case OP_JUMP:   jump = depth;                                       break;
+            case OP_JFALSE:
+            case OP_JTRUE:  depth -= 1; jump = depth;                           break;
+            case OP_NEXT:   jump = depth + 3;                                   break;
+
+            case OP_TCALL:
+            case OP_RET:
+            case OP_RETN:   continue;
+        }
+
+        if (op != OP_JUMP)
+            next = depth;
+
+        if (depth > max)
+            max = depth;
+        if (jump > max)
+            max = jump;
+
+        if (MU_ARG & pc[-1]) {
+            if (jump >= 0) {
+                int target = (pc - code) + 4 + sarg(pc);
+
+                if (depths[target] < 0) {
+                    depths[target] = jump;
+                    pending[count++] = target;
+                }
+
+                mu_assert(depths[target] == jump);
+            }
+
+            pc += mu_size(pc[-1], 0) - 1;
+        }
+
+        if (next >= 0) {
+            int target = pc - code;
+
+            if (depths[target] < 0) {
+                depths[target] = next;
+                pending[count++] = target;
+            }
+
+            mu_assert(depths[target] == next);
+        }
+    }
+
+    mu_dealloc(depths, 2*len * sizeof(int));
+    return max;
+}
+
 // Execute the bytecode
+// The cycle collector is polled before allocating tables and
+// closures, where everything on the stack holds a reference
 var_t mu_exec(fn_t *f, tbl_t *args, tbl_t *scope, eh_t *eh) {
-    var_t stack[f->stack]; // TODO check for overflow
+    var_t stack[f->stack];
 
     register str_t *pc = f->bcode;
     register var_t *sp = stack + f->stack;
 
     while (1) {
         switch (*pc++ >> 3) {
-            case OP_VAR:    sp[-1] = f->vars[arg(pc)]; pc += 2; sp--;                           break;
-            case OP_FN:     sp[-1] = vfn(f->fns[arg(pc)], scope); pc += 2; sp--;                break;
+            case OP_VAR:    sp[-1] = f->vars[arg(pc)]; var_inc(sp[-1]); pc += 2; sp--;          break;
+            case OP_FN:     gc_poll();
+                            sp[-1] = fn_closure(f->fns[arg(pc)], scope, eh); pc += 2; sp--;     break;
             case OP_NIL:    sp[-1] = vnil; sp--;                                                break;
-            case OP_TBL:    sp[-1] = vtbl(tbl_create(0, eh)); sp--;                             break;
-            case OP_SCOPE:  sp[-1] = vtbl(scope); sp--;                                         break;
-            case OP_ARGS:   sp[-1] = vtbl(args); sp--;                                          break;
+            case OP_TBL:    gc_poll(); sp[-1] = vtbl(tbl_create(0, eh)); sp--;                  break;
+            case OP_SCOPE:  sp[-1] = vtbl(scope); tbl_inc(scope); sp--;                         break;
+            case OP_ARGS:   sp[-1] = vtbl(args); tbl_inc(args); sp--;                           break;
             
-            case OP_DUP:    sp[-1] = sp[arg(pc)]; sp -= 1; pc += 2;                             break;
-            case OP_DROP:   sp += 1;                                                            break;
+            case OP_DUP:    sp[-1] = sp[arg(pc)]; var_inc(sp[-1]); sp -= 1; pc += 2;            break;
+            case OP_DROP:   var_dec(*sp++);                                                     break;
 
-            case OP_JUMP:   pc += sarg(pc)+2;                                                   break;
-            case OP_JFALSE: pc += isnil(*sp++) ? sarg(pc)+2 : 2;                                break;
-            case OP_JTRUE:  pc += !isnil(*sp++) ? sarg(pc)+2 : 2;                               break;
+            case OP_JUMP:   pc += sarg(pc)+4;                                                   break;
+            case OP_JFALSE: pc += isnil(*sp) ? sarg(pc)+4 : 4; var_dec(*sp++);                  break;
+            case OP_JTRUE:  pc += !isnil(*sp) ? sarg(pc)+4 : 4; var_dec(*sp++);                 break;
+            case OP_NEXT:   if (next(sp)) { sp -= 3; pc += sarg(pc)+4; } else { pc += 4; }      break;
 
-            case OP_LOOKUP: sp[1] = var_lookup(sp[1], sp[0], eh); sp += 1;                      break;
-            case OP_LOOKDN: sp[1] = var_lookdn(sp[1], sp[0], arg(pc), eh); sp += 1; pc += 2;    break;
+            case OP_LOOKUP: sp[1] = lookup(sp, var_lookup(sp[1], sp[0], eh)); sp += 1;          break;
+            case OP_LOOKDN: sp[1] = lookup(sp, var_lookdn(sp[1], sp[0], arg(pc), eh));
+                            sp += 1; pc += 2;                                                   break;
 
-            case OP_ASSIGN: var_assign(sp[2], sp[1], sp[0], eh); sp += 3;                       break;
+            case OP_ASSIGN: var_assign(sp[2], sp[1], sp[0], eh); var_dec(sp[2]); sp += 3;       break;
             case OP_INSERT: var_insert(sp[2], sp[1], sp[0], eh); sp += 2;                       break;
             case OP_APPEND: var_append(sp[1], sp[0], eh); sp += 1;                              break;
     
-            case OP_ITER:   sp[0] = var_iter(sp[0], eh);                                        break;
+            case OP_ITER:   iter(sp, eh); sp -= 2;                                              break;
             
-            case OP_CALL:   sp[1] = var_call(sp[1], gettbl(sp[0]), eh); sp += 1;                break;
-            case OP_TCALL:  return var_call(sp[1], gettbl(sp[0]), eh); // TODO make sure this is tail calling
-            case OP_RET:    return *sp;
-            case OP_RETN:   return vnil;
+            case OP_CALL:   {   var_t v = var_call(sp[1], gettbl(sp[0]), eh);
+                                var_dec(sp[0]);
+                                var_dec(sp[1]);
+                                sp[1] = v; sp += 1;
+                            }                                                                   break;
+
+            case OP_TCALL:  {   var_t v = var_call(sp[1], gettbl(sp[0]), eh); // TODO make sure this is tail calling
+                                release(sp, stack + f->stack);
+                                return v;
+                            }
+
+            case OP_RET:    release(sp+1, stack + f->stack); return *sp;
+            case OP_RETN:   release(sp, stack + f->stack); return vnil;
         }
     }
 
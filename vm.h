@@ -19,15 +19,20 @@
  * assumptions are needed and a simple virtual machine can be 
  * implemented with just a stack pointer and program counter.
  *
+ * Each slot on the stack holds a reference to its var, which is
+ * released when the slot is consumed or popped. Iterators keep
+ * the table being iterated along with their counters as ints.
+ *
  * Bytecode is represented in 8 bits with optional tailing arguments
- * that can go up to 16 bits. Only 5 bits are used for encoding 
+ * of 16 bits, or 32 bits for the signed offsets of jumps so functions
+ * aren't limited to 64KB of bytecode. Only 5 bits are used for encoding 
  * opcodes, the other 3 are used for flags that may help code generation.
  *
  */
 
 // Instruction components
-typedef uint16_t arg_t;
-typedef int16_t sarg_t;
+typedef uint32_t arg_t;
+typedef int32_t sarg_t;
 
 #define MU_OP 0xf8      // Opcode in top 5 bits
 #define MU_FLAGS 0x07   // Flags in bottom 3 bits
@@ -50,6 +55,7 @@ typedef enum op {
     OP_JUMP   = 0x18, // offset -       -           adds signed offset to pc
     OP_JFALSE = 0x1a, // offset -1      -           jump if top of stack is nil
     OP_JTRUE  = 0x1b, // offset -1      -           jump if top of stack is not nil
+    OP_NEXT   = 0x19, // offset +3      v, k, i     steps iterator s2:s0 and jumps, falls through when done
 
     OP_LOOKUP = 0x04, // -      -1      s1[s0]      looks up s1[s0] onto stack
     OP_LOOKDN = 0x05, // index  -1      s1[s0/i]    looks up either s2[s1] or index s2[s0]
@@ -58,7 +64,7 @@ typedef enum op {
     OP_INSERT = 0x09, // -      -2      s2          inserts s2[s1] with s0 nonrecursively
     OP_APPEND = 0x0a, // -      -1      s1          adds s0 to s1
 
-    OP_ITER   = 0x0c, // -      -       iter(s0)    obtains iterator onto stack
+    OP_ITER   = 0x0c, // -      +2      iter(s0)    pushes iterator state for s0 taking two slots
 
     OP_CALL   = 0x03, // -      -1      s1(s0)      calls function s1(s0) onto stack
     OP_TCALL  = 0x02, // -      -2      ret s1(s0)  returns tailcall of function s1(s0)   
@@ -90,6 +96,9 @@ int mu_size(op_t op, arg_t arg);
 // Encode the specified opcode and return its size
 void mu_encode(mstr_t *code, op_t op, arg_t arg);
 
+// Return the stack slots needed to execute the bytecode
+len_t mu_stack(const str_t *code, tlen_t len, eh_t *eh);
+
 // Execute the bytecode
 var_t mu_exec(fn_t *f, tbl_t *args, tbl_t *scope, eh_t *eh);
 